@@ -0,0 +1,217 @@
+// Copyright (c) 2023 - Schelte Bron
+
+// Gateway commands from websocket clients. Commands are passed to the PIC
+// one at a time, so the response can be matched to the request.
+
+#include "otgwmcu.h"
+#include "debug.h"
+#include "web.h"
+#include "metrics.h"
+#include "proxy.h"
+
+#define CMD_QUEUE_SIZE 8
+#define CMD_TIMEOUT 1000
+#define NOCLIENT 0xff
+
+struct command {
+    uint8_t client;
+    char id[24];
+    char cmd[32];
+};
+
+static struct command queue[CMD_QUEUE_SIZE];
+static byte head = 0, count = 0;
+// The command at the head of the queue has been sent to the PIC
+static bool pending = false;
+static unsigned int sent;
+
+// Responses to a command that don't contain the command code, each
+// followed by a space
+static const char errorcodes[] PROGMEM = "NG SE BV OR NS NF OE ";
+
+static bool errorcode(const char *line) {
+    for (unsigned int i = 0; i < sizeof(errorcodes) / 3; i++) {
+        if (strncmp_P(line, errorcodes + 3 * i, 2) == 0) return true;
+    }
+    return false;
+}
+
+// Extract a value from a flat JSON object. String values are copied
+// without quotes, unless raw is set. Escape sequences are not supported.
+static bool jsonvalue(const char *json, const char *key, char *value, int size, bool raw = false) {
+    const char *s, *end;
+    char pattern[16];
+
+    snprintf_P(pattern, sizeof(pattern), PSTR("\"%s\""), key);
+    s = strstr(json, pattern);
+    if (s == nullptr) return false;
+    s += strlen(pattern);
+    while (isspace(*s)) s++;
+    if (*s++ != ':') return false;
+    while (isspace(*s)) s++;
+    if (*s == '"') {
+        end = strchr(s + 1, '"');
+        if (end == nullptr) return false;
+        if (raw) {
+            end++;
+        } else {
+            s++;
+        }
+    } else {
+        for (end = s; *end && *end != ',' && *end != '}' && !isspace(*end); end++);
+    }
+    if (end == s || end - s >= size) return false;
+    memcpy(value, s, end - s);
+    value[end - s] = '\0';
+    return true;
+}
+
+static bool printable(const char *s) {
+    for (; *s; s++) {
+        if (!isprint((unsigned char)*s)) return false;
+    }
+    return true;
+}
+
+// Ids are copied into the reply as they are. Only accept a plain number,
+// or a string without escape sequences.
+static bool validid(const char *id) {
+    const char *s = id;
+
+    if (*s == '"') {
+        // jsonvalue() made sure the string ends with the closing quote
+        for (s++; *s != '"'; s++) {
+            if (*s == '\\' || !isprint((unsigned char)*s)) return false;
+        }
+        return true;
+    }
+    if (*s == '-') s++;
+    if (!isdigit(*s)) return false;
+    while (isdigit(*s)) s++;
+    if (*s == '.') {
+        if (!isdigit(*++s)) return false;
+        while (isdigit(*s)) s++;
+    }
+    return *s == '\0';
+}
+
+// Copy text into a JSON string, escaping the characters that need it
+static void jsonescape(char *dst, int size, const char *src, int len) {
+    int n = 0;
+
+    for (int i = 0; i < len && src[i]; i++) {
+        char ch = src[i];
+        if (ch == '"' || ch == '\\') {
+            if (n + 2 >= size) break;
+            dst[n++] = '\\';
+            dst[n++] = ch;
+        } else if ((unsigned char)ch < ' ') {
+            if (n + 6 >= size) break;
+            n += sprintf_P(dst + n, PSTR("\\u%04x"), ch);
+        } else {
+            if (n + 1 >= size) break;
+            dst[n++] = ch;
+        }
+    }
+    dst[n] = '\0';
+}
+
+static void reply(uint8_t client, const char *fmt, ...) {
+    char buffer[256];
+    va_list argptr;
+
+    if (client == NOCLIENT) return;
+    va_start(argptr, fmt);
+    vsnprintf_P(buffer, sizeof(buffer), fmt, argptr);
+    va_end(argptr);
+    websocketsend(client, buffer);
+}
+
+// Remove the command at the head of the queue
+static void dequeue() {
+    head = (head + 1) % CMD_QUEUE_SIZE;
+    count--;
+    pending = false;
+}
+
+// Request format: {"id":1,"command":"TT=20.5"}
+void commandqueue(uint8_t client, const char *json) {
+    struct command *entry;
+    char id[24];
+
+    if (!jsonvalue(json, "id", id, sizeof(id), true)) {
+        strcpy_P(id, PSTR("null"));
+    } else if (!validid(id)) {
+        reply(client, PSTR("{\"id\":null,\"error\":\"invalid id\"}"));
+        return;
+    }
+    if (count >= CMD_QUEUE_SIZE) {
+        reply(client, PSTR("{\"id\":%s,\"error\":\"queue full\"}"), id);
+        return;
+    }
+    entry = queue + (head + count) % CMD_QUEUE_SIZE;
+    if (!jsonvalue(json, "command", entry->cmd, sizeof(entry->cmd))
+      || strlen(entry->cmd) < 3 || entry->cmd[2] != '='
+      // A line ending would sneak extra commands through to the PIC
+      || !printable(entry->cmd)) {
+        reply(client, PSTR("{\"id\":%s,\"error\":\"invalid command\"}"), id);
+        return;
+    }
+    strcpy(entry->id, id);
+    entry->client = client;
+    count++;
+}
+
+// Forget the commands of a client that went away
+void commanddrop(uint8_t client) {
+    for (int i = 0; i < count; i++) {
+        struct command *entry = queue + (head + i) % CMD_QUEUE_SIZE;
+        if (entry->client == client) entry->client = NOCLIENT;
+    }
+}
+
+// Check if a line from the PIC is the response to the pending command
+bool commandresponse(const char *line, int len) {
+    struct command *entry = queue + head;
+    char cmd[64], response[96];
+
+    if (!pending) return false;
+    // Drop the line ending
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) len--;
+    if (len == 2) {
+        if (!errorcode(line)) return false;
+    } else if (len < 4 || line[2] != ':' || strncmp(line, entry->cmd, 2) != 0) {
+        return false;
+    }
+    jsonescape(cmd, sizeof(cmd), entry->cmd, sizeof(entry->cmd));
+    jsonescape(response, sizeof(response), line, len);
+    reply(entry->client,
+      PSTR("{\"id\":%s,\"command\":\"%s\",\"response\":\"%s\",\"latency\":%u}"),
+      entry->id, cmd, response, millis() - sent);
+    dequeue();
+    return true;
+}
+
+void commandevent() {
+    struct command *entry = queue + head;
+    char cmd[64];
+
+    if (pending) {
+        if (millis() - sent > CMD_TIMEOUT) {
+            debuglog(PSTR("No response to command %s\n"), entry->cmd);
+            jsonescape(cmd, sizeof(cmd), entry->cmd, sizeof(entry->cmd));
+            reply(entry->client, PSTR("{\"id\":%s,\"command\":\"%s\",\"error\":\"timeout\"}"),
+              entry->id, cmd);
+            dequeue();
+        }
+    } else if (count > 0 && !Pic.busy() && proxylinefree()) {
+        int len = strlen(entry->cmd);
+        if (Pic.availableForWrite() > len) {
+            Pic.write(entry->cmd, len);
+            Pic.write('\r');
+            metrics.uarttx += len + 1;
+            sent = millis();
+            pending = true;
+        }
+    }
+}
@@ -0,0 +1,6 @@
+// Copyright (c) 2023 - Schelte Bron
+
+void commandqueue(uint8_t, const char *);
+void commanddrop(uint8_t);
+bool commandresponse(const char *, int);
+void commandevent();
@@ -1,22 +1,109 @@
 // -*- tcl -*-
 // Limit scrollback to 32 Mb
 const maxkb = 32768
+// Subprotocol for packed message log records
+const protocol = "otlog.bin"
+// Format codes, in the same order as in data.h
+const [FMTNONE, FMTDATE, FMTTIME, FMTRFSENSOR, FMTOVERRIDE, FMTFLOAT,
+       FMTFLAGFLAG, FMTFLAGUBYTE, FMTFLAGLB, FMTUBYTELB, FMTINTEGER,
+       FMTBYTEBYTE, FMTUNSIGNED, FMTUBYTEHB, FMTUBYTEUBYTE] = [...Array(15).keys()]
 
-function connect(name, msgfunc) {
+var tables = null
+
+function start() {
+    // Records can only be decoded when the tables are available
+    fetch("otdata.json").then(r => r.json()).then(data => {
+	tables = data
+	connect("otlog.ws", wsdata, protocol)
+    }).catch(() => connect("otlog.ws", wsdata))
+}
+
+function connect(name, msgfunc, proto) {
     var wsurl = "ws" + document.URL.match("s?://[^?#]+/") + name;
     if ("WebSocket" in window) {
-	ws = new WebSocket(wsurl);
+	ws = proto ? new WebSocket(wsurl, proto) : new WebSocket(wsurl);
     } else if ("MozWebSocket" in window) {
 	ws = new MozWebSocket(wsurl);
     }
     if (ws) {
+        ws.binaryType = "arraybuffer";
         ws.onmessage = msgfunc;
         ws.onclose = teardown;
     }
 }
 
+function pad(num, size = 2) {
+    return num.toString().padStart(size, "0")
+}
+
+function flags(val, cnt = 8) {
+    return val.toString(2).padStart(cnt, "0")
+}
+
+// Produce the same output as otformat()
+function otformat(time, usec, dir, raw) {
+    let value = raw & 0xffff, id = raw >>> 16 & 0xff, type = raw >>> 28 & 7
+    let hb = value >> 8, lb = value & 0xff
+    let str = pad(time.getHours()) + ":" + pad(time.getMinutes()) + ":" +
+      pad(time.getSeconds()) + "." + pad(usec, 6) + "  " + dir +
+      pad(raw.toString(16).toUpperCase(), 8) + "  " + tables.msgtypes[type]
+    str = (str + "    ").substring(0, 40)
+    let fmt = FMTNONE
+    if (id < 128 && tables.msgids[id]) {
+	str += tables.msgids[id]
+	fmt = tables.msgfmts[id]
+    } else {
+	str += "Message ID " + id
+    }
+    str += ": "
+    switch (fmt) {
+      case FMTDATE:
+	return str + tables.datetime[hb + 8] + " " + lb
+      case FMTTIME:
+	return str + tables.datetime[hb >> 5] + " " + pad(hb & 0x1f) + ":" + pad(lb)
+      case FMTRFSENSOR:
+	return str + [hb & 0xf, hb >> 4, lb & 0x3, lb >> 2 & 0x7].join(" ")
+      case FMTOVERRIDE:
+	return str + [hb & 0xf, hb >> 4, lb & 0xf, flags(lb >> 4, 4)].join(" ")
+      case FMTFLOAT:
+	return str + ((value << 16 >> 16) / 256).toFixed(2)
+      case FMTFLAGFLAG:
+	return str + flags(hb) + " " + flags(lb)
+      case FMTFLAGUBYTE:
+	return str + flags(hb) + " " + lb
+      case FMTFLAGLB:
+	return str + flags(lb)
+      case FMTUBYTELB:
+	return str + lb
+      case FMTINTEGER:
+	return str + (value << 16 >> 16)
+      case FMTBYTEBYTE:
+	return str + (hb << 24 >> 24) + " " + (lb << 24 >> 24)
+      case FMTUBYTEHB:
+	return str + hb
+      case FMTUBYTEUBYTE:
+	return str + hb + " " + lb
+      default:
+	return str + value
+    }
+}
+
+// Decode a batch of packed records
+function otrecords(buffer) {
+    let data = new DataView(buffer), lines = []
+    let sec = data.getUint32(0, true)
+    for (let pos = 4; pos + 9 <= data.byteLength; pos += 9) {
+	let usec = data.getUint32(pos, true)
+	let dir = String.fromCharCode(data.getUint8(pos + 4))
+	let raw = data.getUint32(pos + 5, true)
+	let time = new Date((sec + Math.floor(usec / 1000000)) * 1000)
+	lines.push(otformat(time, usec % 1000000, dir, raw))
+    }
+    return lines.join("\n")
+}
+
 function wsdata(evt) {
-    var str = evt.data;
+    var str = evt.data instanceof ArrayBuffer ? otrecords(evt.data) : evt.data;
     var w = document.getElementById("log")
     if (w) {
 	var p = w.parentElement
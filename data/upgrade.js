@@ -1,6 +1,8 @@
 // -*- tcl -*-
 
 let busy = false
+// Locations reported by a verify that don't match the firmware file
+let mismatches = []
 
 let result = [
     "Success",
@@ -115,7 +117,8 @@ window.addEventListener("load", () => {
 })
 
 function handleform(e) {
-    if (e.submitter.value == "download") {
+    if (["download", "verify", "backup", "restore",
+      "savesettings", "loadsettings"].includes(e.submitter.value)) {
 	download(e.target, e.submitter)
 	if (e.preventDefault) e.preventDefault()
 	return false
@@ -132,6 +135,7 @@ function download(form, button) {
     if (w) w.style.width = "0%"
     w = document.getElementById("status")
     if (w) w.innerText = "Please wait ..."
+    mismatches = []
     overlay(true)
 }
 
@@ -153,11 +157,34 @@ function wsdata(evt) {
 	  case "result":
 	    setTimeout(overlay, 5000)
 	    status.push(result[value])
+	    if (mismatches.length > 0) {
+		status.push("differences at " + mismatches.join(" "))
+	    }
+	    break
+	  case "mismatch":
+	    mismatches.push(value.memory + ":0x" + value.addr.toString(16))
+	    console.log("Verify " + value.memory + " 0x" + value.addr.toString(16)
+	      + ": 0x" + value.actual.toString(16)
+	      + ", expected 0x" + value.expected.toString(16))
 	    break
 	  case "errors":
 	  case "retries":
 	    status.push(type + ": " + value)
 	    break
+	  case "fetch":
+	    // Background download of a firmware file
+	    if ("result" in value) {
+		status.push(value.name + ": " + value.result)
+		if (value.result == "updated") {
+		    setTimeout(() => location.reload(), 2000)
+		}
+	    } else if (value.size > 0) {
+		let pct = Math.round(100 * value.received / value.size)
+		status.push(value.name + ": " + pct + "%")
+	    } else {
+		status.push(value.name + ": " + value.received + " bytes")
+	    }
+	    break
 	  case "processor":
 	  case "firmware":
 	    // Set the global variable
@@ -0,0 +1,405 @@
+// Copyright (c) 2023 - Schelte Bron
+
+#include <Arduino.h>
+#include "deflate.h"
+
+#define NIL 0xffff
+#define HASHBITS 8
+#define HASHSIZE (1 << HASHBITS)
+#define MINMATCH 3
+#define MAXMATCH 258
+#define MAXCHAIN 16
+
+static const uint16_t lenbase[] PROGMEM = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const uint8_t lenextra[] PROGMEM = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static const uint16_t distbase[] PROGMEM = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+    8193, 12289, 16385, 24577
+};
+static const uint8_t distextra[] PROGMEM = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+// Order of the code length code lengths in a dynamic block header
+static const uint8_t clorder[] PROGMEM = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+Deflate::Deflate(uint8_t windowbits, bool takeover)
+: _takeover(takeover) {
+    windowbits = constrain(windowbits, DEFLATE_MIN_BITS, DEFLATE_MAX_BITS);
+    _wsize = 1 << windowbits;
+    // The window holds the history plus the data being compressed
+    _window = new uint8_t[2 * _wsize];
+    _prev = new uint16_t[_wsize];
+    _head = new uint16_t[HASHSIZE];
+    reset();
+}
+
+Deflate::~Deflate() {
+    delete[] _window;
+    delete[] _prev;
+    delete[] _head;
+}
+
+// Forget the history. Referring to less history than the peer has
+// available is always allowed, so this can be done at any time.
+void Deflate::reset() {
+    _fill = 0;
+    for (int i = 0; i < HASHSIZE; i++) _head[i] = NIL;
+}
+
+// Discard the oldest half of the window
+void Deflate::slide() {
+    uint16_t *p;
+
+    memmove(_window, _window + _wsize, _fill - _wsize);
+    _fill -= _wsize;
+    for (p = _head; p < _head + HASHSIZE; p++) {
+        *p = (*p == NIL || *p < _wsize) ? NIL : *p - _wsize;
+    }
+    for (p = _prev; p < _prev + _wsize; p++) {
+        *p = (*p == NIL || *p < _wsize) ? NIL : *p - _wsize;
+    }
+}
+
+static inline uint16_t hash(const uint8_t *s) {
+    return (s[0] << 4 ^ s[1] << 2 ^ s[2]) & (HASHSIZE - 1);
+}
+
+void Deflate::insert(uint16_t pos) {
+    uint16_t h = hash(_window + pos);
+    _prev[pos & (_wsize - 1)] = _head[h];
+    _head[h] = pos;
+}
+
+// Find the longest match for the string at pos in the preceding window
+uint16_t Deflate::match(uint16_t pos, uint16_t end, uint16_t &dist) {
+    uint16_t cand, next, len, best = MINMATCH - 1;
+    uint16_t limit = pos > _wsize ? pos - _wsize : 0;
+    uint16_t maxlen = min(end - pos, MAXMATCH);
+    const uint8_t *s = _window + pos;
+    int chain = MAXCHAIN;
+
+    if (maxlen < MINMATCH) return 0;
+    cand = _head[hash(s)];
+    while (cand != NIL && cand < pos && cand >= limit && chain-- > 0) {
+        const uint8_t *t = _window + cand;
+        if (t[best] == s[best]) {
+            for (len = 0; len < maxlen && t[len] == s[len]; len++);
+            if (len > best) {
+                best = len;
+                dist = pos - cand;
+                if (len >= maxlen) break;
+            }
+        }
+        next = _prev[cand & (_wsize - 1)];
+        // The chain must run backwards, or the entry is stale
+        if (next == NIL || next >= cand) break;
+        cand = next;
+    }
+    return best >= MINMATCH ? best : 0;
+}
+
+void Deflate::putbits(uint32_t value, uint8_t count) {
+    _bitbuf |= value << _bitcnt;
+    _bitcnt += count;
+    while (_bitcnt >= 8) {
+        if (_outpos < _outsize) _out[_outpos] = _bitbuf & 0xff;
+        _outpos++;
+        _bitbuf >>= 8;
+        _bitcnt -= 8;
+    }
+}
+
+// Huffman codes are stored starting with the most significant bit
+void Deflate::putcode(uint16_t code, uint8_t count) {
+    uint16_t rev = 0;
+    for (uint8_t i = 0; i < count; i++, code >>= 1) {
+        rev = rev << 1 | (code & 1);
+    }
+    putbits(rev, count);
+}
+
+void Deflate::literal(uint8_t ch) {
+    if (ch < 144) {
+        putcode(0x30 + ch, 8);
+    } else {
+        putcode(0x190 + ch - 144, 9);
+    }
+}
+
+void Deflate::copy(uint16_t len, uint16_t dist) {
+    int i;
+
+    for (i = 28; pgm_read_word(lenbase + i) > len; i--);
+    if (i < 23) {
+        putcode(i + 1, 7);              // Symbols 257 - 279
+    } else {
+        putcode(0xc0 + i - 23, 8);      // Symbols 280 - 285
+    }
+    putbits(len - pgm_read_word(lenbase + i), pgm_read_byte(lenextra + i));
+    for (i = 29; pgm_read_word(distbase + i) > dist; i--);
+    putcode(i, 5);
+    putbits(dist - pgm_read_word(distbase + i), pgm_read_byte(distextra + i));
+}
+
+// Compress a complete message. Returns the compressed size, or 0 if it
+// didn't fit in the output buffer. In that case the message must be sent
+// uncompressed.
+size_t Deflate::compress(const uint8_t *in, size_t len, uint8_t *out, size_t size) {
+    uint16_t pos, end, n, mlen, dist;
+
+    _out = out;
+    _outpos = 0;
+    _outsize = size;
+    _bitbuf = 0;
+    _bitcnt = 0;
+
+    if (!_takeover) reset();
+
+    // Block header: BFINAL = 0, BTYPE = 01 (fixed huffman codes)
+    putbits(2, 3);
+    while (len > 0) {
+        n = min(len, (size_t)_wsize);
+        if (_fill + n > 2 * _wsize) slide();
+        memcpy(_window + _fill, in, n);
+        pos = _fill;
+        end = _fill + n;
+        while (pos < end) {
+            mlen = match(pos, end, dist);
+            if (mlen) {
+                copy(mlen, dist);
+            } else {
+                literal(_window[pos]);
+                mlen = 1;
+            }
+            for (; mlen > 0; mlen--, pos++) {
+                if (pos + MINMATCH <= end) insert(pos);
+            }
+        }
+        _fill = end;
+        in += n;
+        len -= n;
+    }
+    // End of block
+    putcode(0, 7);
+    // Sync flush: An empty stored block, of which the LEN and NLEN fields
+    // are omitted on the wire (RFC 7692, section 7.2.1)
+    putbits(0, 3);
+    if (_bitcnt) putbits(0, 8 - _bitcnt);
+
+    if (_outpos > _outsize) {
+        // The message is sent uncompressed, so it is not part of the
+        // history the peer knows about
+        reset();
+        return 0;
+    }
+    return _outpos;
+}
+
+// Decompression of messages from the client. The handshake requires the
+// client not to use context takeover, so the output buffer is the window.
+struct Huffman {
+    uint16_t count[16];
+    uint16_t symbol[288];
+};
+
+class Inflater {
+public:
+   Inflater(const uint8_t *in, size_t len, uint8_t *out, size_t size)
+   : in(in), len(len), out(out), size(size) {}
+   int run();
+protected:
+   const uint8_t *in;
+   size_t len, inpos = 0;
+   uint8_t *out;
+   size_t size, outpos = 0;
+   uint8_t bitbuf = 0, bitcnt = 0;
+   bool error = false;
+
+   int nextbyte();
+   unsigned bits(int n);
+   int decode(const Huffman *h);
+   void build(Huffman *h, const uint8_t *length, int n);
+   bool stored();
+   bool dynamic(Huffman *lencode, Huffman *distcode, uint8_t *lengths);
+   bool codes(const Huffman *lencode, const Huffman *distcode);
+};
+
+int Inflater::nextbyte() {
+    // Restore the 0x00 0x00 0xff 0xff removed by the sender
+    static const uint8_t tail[] = {0x00, 0x00, 0xff, 0xff};
+    if (inpos < len) return in[inpos++];
+    if (inpos < len + 4) return tail[inpos++ - len];
+    error = true;
+    return 0;
+}
+
+unsigned Inflater::bits(int n) {
+    unsigned val = 0;
+    for (int i = 0; i < n; i++) {
+        if (bitcnt == 0) {
+            bitbuf = nextbyte();
+            bitcnt = 8;
+        }
+        val |= (bitbuf & 1) << i;
+        bitbuf >>= 1;
+        bitcnt--;
+    }
+    return val;
+}
+
+void Inflater::build(Huffman *h, const uint8_t *length, int n) {
+    uint16_t offs[16];
+    int i;
+
+    memset(h->count, 0, sizeof(h->count));
+    for (i = 0; i < n; i++) h->count[length[i]]++;
+    h->count[0] = 0;
+    offs[1] = 0;
+    for (i = 1; i < 15; i++) offs[i + 1] = offs[i] + h->count[i];
+    for (i = 0; i < n; i++) {
+        if (length[i]) h->symbol[offs[length[i]]++] = i;
+    }
+}
+
+int Inflater::decode(const Huffman *h) {
+    int code = 0, first = 0, index = 0;
+
+    for (int len = 1; len < 16; len++) {
+        code |= bits(1);
+        int count = h->count[len];
+        if (code - first < count) return h->symbol[index + code - first];
+        index += count;
+        first = (first + count) << 1;
+        code <<= 1;
+        if (error) break;
+    }
+    error = true;
+    return -1;
+}
+
+bool Inflater::stored() {
+    unsigned n;
+
+    // Discard the remaining bits of the current byte
+    bitcnt = 0;
+    n = nextbyte();
+    n |= nextbyte() << 8;
+    if ((unsigned)(nextbyte() | nextbyte() << 8) != (~n & 0xffff)) return false;
+    if (outpos + n > size) return false;
+    while (n-- > 0) out[outpos++] = nextbyte();
+    return !error;
+}
+
+bool Inflater::codes(const Huffman *lencode, const Huffman *distcode) {
+    int sym;
+    unsigned len, dist;
+
+    while (!error) {
+        sym = decode(lencode);
+        if (sym < 256) {
+            if (sym < 0 || outpos >= size) return false;
+            out[outpos++] = sym;
+        } else if (sym == 256) {
+            return true;
+        } else {
+            sym -= 257;
+            if (sym >= 29) return false;
+            len = pgm_read_word(lenbase + sym) + bits(pgm_read_byte(lenextra + sym));
+            sym = decode(distcode);
+            if (sym < 0 || sym >= 30) return false;
+            dist = pgm_read_word(distbase + sym) + bits(pgm_read_byte(distextra + sym));
+            if (dist > outpos || outpos + len > size) return false;
+            for (; len > 0; len--, outpos++) {
+                out[outpos] = out[outpos - dist];
+            }
+        }
+    }
+    return false;
+}
+
+bool Inflater::dynamic(Huffman *lencode, Huffman *distcode, uint8_t *lengths) {
+    int nlen, ndist, ncode, i, sym, prev, rep;
+
+    nlen = bits(5) + 257;
+    ndist = bits(5) + 1;
+    ncode = bits(4) + 4;
+    if (nlen > 286 || ndist > 30) return false;
+    memset(lengths, 0, 19);
+    for (i = 0; i < ncode; i++) {
+        lengths[pgm_read_byte(clorder + i)] = bits(3);
+    }
+    build(lencode, lengths, 19);
+    for (i = 0; i < nlen + ndist && !error;) {
+        sym = decode(lencode);
+        if (sym < 16) {
+            lengths[i++] = sym;
+            continue;
+        }
+        prev = 0;
+        if (sym == 16) {
+            if (i == 0) return false;
+            prev = lengths[i - 1];
+            rep = 3 + bits(2);
+        } else if (sym == 17) {
+            rep = 3 + bits(3);
+        } else {
+            rep = 11 + bits(7);
+        }
+        if (i + rep > nlen + ndist) return false;
+        while (rep-- > 0) lengths[i++] = prev;
+    }
+    if (error) return false;
+    build(lencode, lengths, nlen);
+    build(distcode, lengths + nlen, ndist);
+    return true;
+}
+
+int Inflater::run() {
+    Huffman lencode, distcode;
+    uint8_t lengths[288 + 30];
+    bool last = false, ok;
+
+    // Stop at the final block, or when all input has been consumed
+    while (!last && inpos < len + 4) {
+        last = bits(1);
+        switch (bits(2)) {
+         case 0:
+            ok = stored();
+            break;
+         case 1:
+            memset(lengths, 8, 144);
+            memset(lengths + 144, 9, 112);
+            memset(lengths + 256, 7, 24);
+            memset(lengths + 280, 8, 8);
+            build(&lencode, lengths, 288);
+            memset(lengths, 5, 30);
+            build(&distcode, lengths, 30);
+            ok = codes(&lencode, &distcode);
+            break;
+         case 2:
+            ok = dynamic(&lencode, &distcode, lengths) && codes(&lencode, &distcode);
+            break;
+         default:
+            ok = false;
+            break;
+        }
+        if (!ok || error) return -1;
+    }
+    return outpos;
+}
+
+// Decompress a message. Returns the decompressed size, or -1 on failure.
+int Deflate::inflate(const uint8_t *in, size_t len, uint8_t *out, size_t size) {
+    Inflater inflater(in, len, out, size);
+    return inflater.run();
+}
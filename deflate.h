@@ -0,0 +1,42 @@
+// Copyright (c) 2023 - Schelte Bron
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Window sizes that can be used without exhausting the ESP8266 memory
+#define DEFLATE_MIN_BITS 8
+#define DEFLATE_MAX_BITS 12
+
+// Compressor for the permessage-deflate websocket extension (RFC 7692).
+// Uses the fixed huffman codes of RFC 1951 with a small LZ77 window. With
+// context takeover the window carries over to the next message, which is
+// where most of the gain comes from for short, repetitive messages.
+class Deflate {
+public:
+   Deflate(uint8_t windowbits, bool takeover = true);
+   ~Deflate();
+
+   size_t compress(const uint8_t *in, size_t len, uint8_t *out, size_t size);
+   static size_t bound(size_t len) {return len + (len >> 3) + 16;}
+   static int inflate(const uint8_t *in, size_t len, uint8_t *out, size_t size);
+
+protected:
+   uint8_t *_window;
+   uint16_t *_head, *_prev;
+   uint16_t _wsize, _fill;
+   bool _takeover;
+   // Bit output
+   uint8_t *_out;
+   size_t _outpos, _outsize;
+   uint32_t _bitbuf;
+   uint8_t _bitcnt;
+
+   void reset();
+   void slide();
+   void insert(uint16_t pos);
+   uint16_t match(uint16_t pos, uint16_t end, uint16_t &dist);
+   void putbits(uint32_t value, uint8_t count);
+   void putcode(uint16_t code, uint8_t count);
+   void literal(uint8_t ch);
+   void copy(uint16_t len, uint16_t dist);
+};
@@ -0,0 +1,501 @@
+// Copyright (c) 2023 - Schelte Bron
+
+// Background download of PIC firmware files. The download runs as a state
+// machine from the main loop, so it doesn't hold up the other tasks. Even
+// the name lookup and the connection setup don't block: they are started
+// through lwIP directly and the state machine polls for the result.
+// The request is conditional: Files that haven't changed since the last
+// download are not transferred again.
+// The same mechanism periodically checks for a new version of the MCU
+// firmware. The result is kept in RAM for otainfo.json.
+
+#include "otgwmcu.h"
+#include "debug.h"
+#include "web.h"
+#include "manifest.h"
+#include "filewriter.h"
+#include "version.h"
+#include <ESP8266WiFi.h>
+extern "C" {
+#include <lwip/dns.h>
+#include <lwip/tcp.h>
+}
+#include <include/ClientContext.h>
+
+#define FETCH_QUEUE_SIZE 8
+#define FETCH_CHUNK 512
+// Maximum time spent per call of fetchevent() (us)
+#define FETCH_TIME 4000
+// Give up if the server doesn't send anything for this long (ms). This
+// also applies to the name lookup and to establishing the connection.
+#define FETCH_TIMEOUT 10000
+// Check for a new version of the MCU firmware every 6 hours
+#define OTA_CHECK_INTERVAL (6 * 3600 * 1000UL)
+// Try again sooner when the check failed, backing off on repeated failures
+#define OTA_RETRY_INTERVAL (300 * 1000UL)
+#define OTA_RETRY_BACKOFF 6
+
+enum {
+    FETCH_IDLE,
+    FETCH_RESOLVE,
+    FETCH_CONNECT,
+    FETCH_HEADERS,
+    FETCH_BODY
+};
+
+enum {
+    JOB_FILE,
+    JOB_VERSION
+};
+
+static char queue[FETCH_QUEUE_SIZE][40];
+static byte head = 0, count = 0;
+
+// WiFiClient only provides a blocking connect. A connection that was set
+// up by fetchconnect() is handed over to it, like WiFiServer does for
+// incoming connections.
+class FetchClient : public WiFiClient {
+public:
+   FetchClient(ClientContext *ctx) : WiFiClient(ctx) {}
+};
+
+static WiFiClient client;
+static String host, request;
+static int port;
+// State of the name lookup and connection setup, updated by lwIP callbacks
+static ip_addr_t address;
+static volatile int8_t resolved, connected;
+static uintptr_t lookup = 0;
+static struct tcp_pcb *pcb = nullptr;
+static ClientContext *context = nullptr;
+static FileWriter file;
+static byte state = FETCH_IDLE, job;
+static int status, length, received;
+static unsigned int activity, reported;
+static char line[128];
+static int linelen;
+static char version[16], modified[40], latest[16], lastmod[40];
+
+// Latest MCU firmware version
+static char otalatest[16] = "unknown";
+static bool otarequest = true, otavalid = false;
+static unsigned int otachecked, otaupdated;
+static byte otafailures = 0;
+
+// Allow a local server to stand in for the download server
+static String downloadurl() {
+    String rc;
+    File f = LittleFS.open("/fetchurl.txt", "r");
+    if (f) {
+        rc = f.readStringUntil('\n');
+        f.close();
+        if (rc.endsWith("\r")) rc.remove(rc.length() - 1);
+    } else {
+        rc = F(DOWNLOAD_URL);
+    }
+    return rc;
+}
+
+// Read a line from a file, without the line ending
+static void readline(File &f, char *buffer, int size) {
+    int n = f.readBytesUntil('\n', buffer, size - 1);
+    if (n > 0 && buffer[n - 1] == '\r') n--;
+    buffer[n] = '\0';
+}
+
+static String verfile(const char *filename) {
+    String path = "/" + String(filename);
+    path.replace(".hex", ".ver");
+    return path;
+}
+
+bool fetchqueue(const char *filename) {
+    if (count >= FETCH_QUEUE_SIZE || strlen(filename) >= sizeof(*queue)) {
+        return false;
+    }
+    for (int i = 0; i < count; i++) {
+        if (strcmp(queue[(head + i) % FETCH_QUEUE_SIZE], filename) == 0) {
+            return true;
+        }
+    }
+    strcpy(queue[(head + count) % FETCH_QUEUE_SIZE], filename);
+    count++;
+    return true;
+}
+
+bool fetchbusy() {
+    return state != FETCH_IDLE || count > 0;
+}
+
+// Schedule a check for a new version of the MCU firmware
+void otacheck() {
+    otarequest = true;
+}
+
+// Get the latest MCU firmware version. Returns the age of the information
+// in seconds, or -1 if the check has not succeeded yet.
+int otaversion(char *buffer, int size) {
+    strlcpy(buffer, otalatest, size);
+    return otavalid ? (millis() - otaupdated) / 1000 : -1;
+}
+
+// Abandon a connection that is still being set up
+static void fetchcancel() {
+    // Ignore the result of a name lookup that is still running
+    lookup++;
+    if (pcb) {
+        tcp_arg(pcb, nullptr);
+        tcp_err(pcb, nullptr);
+        tcp_abort(pcb);
+        pcb = nullptr;
+    }
+    if (context) {
+        // Nobody took over the connection yet
+        FetchClient(context).stop();
+        context = nullptr;
+    }
+}
+
+static void fetchdone(const char *result) {
+    if (job == JOB_VERSION) {
+        debuglog(PSTR("Version check: %s\n"), result);
+        // Schedule a retry, versionfinish() overrides this on success
+        unsigned long retry = OTA_RETRY_INTERVAL << otafailures;
+        if (retry > OTA_CHECK_INTERVAL) retry = OTA_CHECK_INTERVAL;
+        if (otafailures < OTA_RETRY_BACKOFF) otafailures++;
+        otachecked = millis() - OTA_CHECK_INTERVAL + retry;
+    } else {
+        const char *name = queue[head];
+        debuglog(PSTR("Update %s: %s\n"), name, result);
+        websockprogress(PSTR("{\"fetch\":{\"name\":\"%s\",\"result\":\"%s\"}}"), name, result);
+        head = (head + 1) % FETCH_QUEUE_SIZE;
+        count--;
+    }
+    file.discard();
+    fetchcancel();
+    client.stop();
+    state = FETCH_IDLE;
+}
+
+static void fetchresolved(const char *name, const ip_addr_t *ip, void *arg) {
+    if ((uintptr_t)arg != lookup) return;
+    if (ip) {
+        address = *ip;
+        resolved = 1;
+    } else {
+        resolved = -1;
+    }
+}
+
+static err_t fetchconnected(void *arg, struct tcp_pcb *tpcb, err_t err) {
+    // From here on, the client context handles the lwIP callbacks
+    context = new ClientContext(tpcb, nullptr, nullptr);
+    pcb = nullptr;
+    connected = 1;
+    return ERR_OK;
+}
+
+static void fetcherror(void *arg, err_t err) {
+    // lwIP has already freed the connection
+    pcb = nullptr;
+    connected = -1;
+}
+
+// Prepare a GET request for a file relative to a base url. The request
+// is sent once the connection has been established.
+static void fetchrequest(String url, const char *name) {
+    int pos;
+
+    // Only plain http is supported
+    if (!url.startsWith("http://")) {
+        fetchdone("bad url");
+        return;
+    }
+    url.remove(0, 7);
+    pos = url.indexOf('/');
+    if (pos < 0) pos = url.length();
+    host = url.substring(0, pos);
+    url.remove(0, pos);
+    port = 80;
+    pos = host.indexOf(':');
+    if (pos >= 0) {
+        port = host.substring(pos + 1).toInt();
+        host.remove(pos);
+    }
+    request = url + "/" + name;
+
+    // Start looking up the server. Numeric addresses and cached names are
+    // available right away.
+    resolved = 0;
+    switch (dns_gethostbyname(host.c_str(), &address, fetchresolved, (void *)++lookup)) {
+     case ERR_OK:
+        resolved = 1;
+        break;
+     case ERR_INPROGRESS:
+        break;
+     default:
+        fetchdone("unknown host");
+        return;
+    }
+    activity = millis();
+    state = FETCH_RESOLVE;
+}
+
+// Start setting up the connection to the server
+static void fetchconnect() {
+    pcb = tcp_new();
+    if (pcb == nullptr) {
+        fetchdone("out of memory");
+        return;
+    }
+    tcp_arg(pcb, nullptr);
+    tcp_err(pcb, fetcherror);
+    connected = 0;
+    if (tcp_connect(pcb, &address, port, fetchconnected) != ERR_OK) {
+        fetchdone("connection failed");
+        return;
+    }
+    activity = millis();
+    state = FETCH_CONNECT;
+}
+
+// The connection is established, send the request
+static void fetchsend() {
+    client = FetchClient(context);
+    context = nullptr;
+    client.setNoDelay(true);
+    // HTTP/1.0 avoids chunked transfer encoding
+    client.printf_P(PSTR("GET %s HTTP/1.0\r\nHost: %s\r\n"
+      "User-Agent: OTGWMCU " VERSION "\r\n"), request.c_str(), host.c_str());
+    if (job == JOB_VERSION) {
+        client.printf_P(PSTR("x-ESP8266-STA-MAC: %s\r\n"), WiFi.macAddress().c_str());
+    } else if (modified[0]) {
+        client.printf_P(PSTR("If-Modified-Since: %s\r\n"), modified);
+    }
+    client.print(F("\r\n"));
+
+    status = 0;
+    length = -1;
+    received = 0;
+    linelen = 0;
+    latest[0] = lastmod[0] = '\0';
+    activity = millis();
+    state = FETCH_HEADERS;
+}
+
+static void fetchstart() {
+    const char *name = queue[head];
+
+    job = JOB_FILE;
+    // Get the version and modification time of the current file
+    version[0] = modified[0] = '\0';
+    File f = LittleFS.open(verfile(name), "r");
+    if (f) {
+        readline(f, version, sizeof(version));
+        readline(f, modified, sizeof(modified));
+        f.close();
+    }
+    if (!LittleFS.exists("/" + String(name))) modified[0] = '\0';
+    fetchrequest(downloadurl(), name);
+}
+
+static void versionstart() {
+    job = JOB_VERSION;
+    otarequest = false;
+    fetchrequest(otaurl(), "version.txt");
+}
+
+static void fetchheader() {
+    char *value = strchr(line, ':');
+
+    if (status == 0) {
+        if (sscanf_P(line, PSTR("HTTP/%*d.%*d %d"), &status) != 1) status = -1;
+        return;
+    }
+    if (value == nullptr) return;
+    *value++ = '\0';
+    while (*value == ' ') value++;
+    if (strcasecmp_P(line, PSTR("Content-Length")) == 0) {
+        length = atoi(value);
+    } else if (strcasecmp_P(line, PSTR("X-Version")) == 0) {
+        strlcpy(latest, value, sizeof(latest));
+    } else if (strcasecmp_P(line, PSTR("Last-Modified")) == 0) {
+        strlcpy(lastmod, value, sizeof(lastmod));
+    }
+}
+
+// All headers have been received
+static void fetchbody() {
+    const char *name = queue[head];
+
+    if (job == JOB_VERSION) {
+        // The body is collected in the line buffer
+        if (status == 200) {
+            linelen = 0;
+            state = FETCH_BODY;
+        } else {
+            fetchdone("failed");
+        }
+    } else if (status == 304) {
+        fetchdone("unchanged");
+    } else if (status != 200) {
+        char result[24];
+        sprintf_P(result, PSTR("error %d"), status);
+        fetchdone(result);
+    } else if (latest[0] && strcmp(latest, version) == 0) {
+        // The server doesn't support conditional requests
+        fetchdone("unchanged");
+    } else if (length < 0) {
+        // Without a length, a dropped connection looks like the end of the file
+        fetchdone("no content length");
+    } else {
+        debuglog(PSTR("Update %s: %s -> %s\n"), name, version, latest);
+        if (!file.open("/" + String(name) + ".tmp")) {
+            fetchdone("failed to create file");
+            return;
+        }
+        reported = 0;
+        state = FETCH_BODY;
+    }
+}
+
+static void versionfinish() {
+    char *s = line;
+
+    line[linelen] = '\0';
+    // Remove the newline at the end of the file
+    while (isspace(*s)) s++;
+    for (int i = strlen(s); i > 0 && isspace(s[i - 1]); i--) s[i - 1] = '\0';
+    if (*s) {
+        strlcpy(otalatest, s, sizeof(otalatest));
+        fetchdone(otalatest);
+        otavalid = true;
+        otafailures = 0;
+        otachecked = otaupdated = millis();
+    } else {
+        fetchdone("empty response");
+    }
+}
+
+// Move the downloaded file in place
+static void fetchfinish() {
+    const char *name = queue[head];
+    String path = "/" + String(name);
+    String tmpfile = file.path();
+
+    if (received != length) {
+        fetchdone("incomplete");
+        return;
+    }
+    if (!file.close()) {
+        fetchdone("write failed");
+        LittleFS.remove(tmpfile);
+        return;
+    }
+    // Renaming replaces the old file, which is kept if anything goes wrong
+    if (!LittleFS.rename(tmpfile, path)) {
+        fetchdone("rename failed");
+        LittleFS.remove(tmpfile);
+        return;
+    }
+    // The preparsed image belongs to the old file
+    String imgfile = path;
+    imgfile.replace(".hex", ".img");
+    LittleFS.remove(imgfile);
+    File f = LittleFS.open(verfile(name), "w");
+    if (f) {
+        f.printf("%s\n%s\n", latest[0] ? latest : version, lastmod);
+        f.close();
+    }
+    manifestupdate(path);
+    fetchdone("updated");
+}
+
+void fetchevent() {
+    uint8_t buffer[FETCH_CHUNK];
+    unsigned long start = micros();
+    int len;
+
+    switch (state) {
+     case FETCH_IDLE:
+        if (otarequest || millis() - otachecked > OTA_CHECK_INTERVAL) {
+            versionstart();
+        } else if (count > 0) {
+            fetchstart();
+        }
+        return;
+     case FETCH_RESOLVE:
+        if (resolved > 0) {
+            fetchconnect();
+        } else if (resolved < 0) {
+            fetchdone("unknown host");
+        } else if (millis() - activity > FETCH_TIMEOUT) {
+            fetchdone("name lookup timeout");
+        }
+        return;
+     case FETCH_CONNECT:
+        if (connected > 0) {
+            fetchsend();
+        } else if (connected < 0) {
+            fetchdone("connection failed");
+        } else if (millis() - activity > FETCH_TIMEOUT) {
+            fetchdone("connection timeout");
+        }
+        return;
+     case FETCH_HEADERS:
+        while (client.available()) {
+            int ch = client.read();
+            activity = millis();
+            if (ch == '\n') {
+                if (linelen > 0 && line[linelen - 1] == '\r') linelen--;
+                line[linelen] = '\0';
+                if (linelen == 0) {
+                    fetchbody();
+                    return;
+                }
+                fetchheader();
+                linelen = 0;
+            } else if (linelen < sizeof(line) - 1) {
+                line[linelen++] = ch;
+            }
+        }
+        break;
+     case FETCH_BODY:
+        if (job == JOB_VERSION) {
+            while (client.available() && linelen < sizeof(line) - 1) {
+                line[linelen++] = client.read();
+                activity = millis();
+            }
+            if (linelen >= sizeof(line) - 1 || !client.connected()) {
+                versionfinish();
+                return;
+            }
+            break;
+        }
+        while ((len = client.available()) > 0 && micros() - start < FETCH_TIME) {
+            if (len > sizeof(buffer)) len = sizeof(buffer);
+            len = client.read(buffer, len);
+            if (file.write(buffer, len) != (size_t)len) {
+                fetchdone("write failed");
+                return;
+            }
+            received += len;
+            activity = millis();
+        }
+        if (millis() - reported > 500) {
+            websockprogress(PSTR("{\"fetch\":{\"name\":\"%s\",\"received\":%d,\"size\":%d}}"),
+              queue[head], received, length);
+            reported = millis();
+        }
+        if (received >= length) {
+            fetchfinish();
+            return;
+        }
+        break;
+    }
+    if (!client.connected() && !client.available()) {
+        fetchdone("connection closed");
+    } else if (millis() - activity > FETCH_TIMEOUT) {
+        fetchdone("timeout");
+    }
+}
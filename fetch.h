@@ -0,0 +1,7 @@
+// Copyright (c) 2023 - Schelte Bron
+
+bool fetchqueue(const char *filename);
+bool fetchbusy();
+void fetchevent();
+void otacheck();
+int otaversion(char *, int);
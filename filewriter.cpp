@@ -0,0 +1,93 @@
+// Copyright (c) 2023 - Schelte Bron
+
+#include <Arduino.h>
+#include <LittleFS.h>
+#include "filewriter.h"
+
+FileWriterStats FileWriter::_stats;
+
+FileWriter::FileWriter()
+: _buffer(nullptr), _fill(0), _size(0), _error(false) {
+}
+
+FileWriter::~FileWriter() {
+    close();
+}
+
+bool FileWriter::open(const String &path) {
+    close();
+    _file = LittleFS.open(path, "w");
+    if (!_file) return false;
+    _buffer = new uint8_t[FILEWRITER_SIZE];
+    _path = path;
+    _fill = 0;
+    _size = 0;
+    _error = false;
+    return true;
+}
+
+// Write data from the buffer or directly from the caller
+bool FileWriter::flush(const uint8_t *data, size_t len) {
+    unsigned long start = micros();
+    size_t n = _file.write(data, len);
+    unsigned long time = micros() - start;
+    _stats.bytes += n;
+    _stats.writes++;
+    _stats.time += time;
+    if (time > _stats.maxtime) _stats.maxtime = time;
+    // Once part of the data is lost, the file can't be completed anymore
+    if (n != len) _error = true;
+    return !_error;
+}
+
+size_t FileWriter::write(const uint8_t *data, size_t len) {
+    size_t n, done = 0;
+
+    if (!_file || _error) return 0;
+    if (_fill > 0) {
+        // Top up the buffer
+        n = FILEWRITER_SIZE - _fill;
+        if (n > len) n = len;
+        memcpy(_buffer + _fill, data, n);
+        _fill += n;
+        done += n;
+        if (_fill < FILEWRITER_SIZE) {
+            _size += done;
+            return done;
+        }
+        if (!flush(_buffer, _fill)) return 0;
+        _fill = 0;
+    }
+    // Write complete buffers worth of data without copying
+    n = (len - done) / FILEWRITER_SIZE * FILEWRITER_SIZE;
+    if (n > 0) {
+        if (!flush(data + done, n)) return 0;
+        done += n;
+    }
+    // Keep the remainder for later
+    memcpy(_buffer, data + done, len - done);
+    _fill = len - done;
+    _size += len;
+    return len;
+}
+
+bool FileWriter::close() {
+    bool rc;
+
+    if (!_file) return false;
+    if (_fill > 0 && !_error) flush(_buffer, _fill);
+    rc = !_error;
+    _file.close();
+    delete[] _buffer;
+    _buffer = nullptr;
+    _fill = 0;
+    return rc;
+}
+
+// Close and remove an incomplete file
+void FileWriter::discard() {
+    if (!_file) return;
+    _fill = 0;
+    close();
+    LittleFS.remove(_path);
+}
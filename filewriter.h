@@ -0,0 +1,43 @@
+// Copyright (c) 2023 - Schelte Bron
+
+#include <FS.h>
+
+// The file system is built with a page size of 256 bytes. Writes are
+// collected until a number of complete pages can be written at once.
+#define FILEWRITER_PAGE 256
+#define FILEWRITER_SIZE (4 * FILEWRITER_PAGE)
+
+typedef struct {
+    uint32_t bytes;     // Bytes written to flash
+    uint32_t writes;    // Write calls to the file system
+    uint32_t time;      // Total time spent writing (us)
+    uint32_t maxtime;   // Longest single write (us)
+} FileWriterStats;
+
+// Buffered writer for files that are received in arbitrary pieces, like
+// uploads and downloads
+class FileWriter {
+public:
+   FileWriter();
+   ~FileWriter();
+
+   bool open(const String &path);
+   size_t write(const uint8_t *data, size_t len);
+   bool close();
+   void discard();
+   size_t size() {return _size;}
+   // A write to the file system failed since the file was opened
+   bool failed() {return _error;}
+   const String &path() {return _path;}
+   operator bool() {return _file;}
+   static const FileWriterStats &stats() {return _stats;}
+
+protected:
+   File _file;
+   String _path;
+   uint8_t *_buffer;
+   size_t _fill, _size;
+   bool _error;
+   static FileWriterStats _stats;
+   bool flush(const uint8_t *, size_t);
+};
@@ -0,0 +1,61 @@
+// Copyright (c) 2023 - Schelte Bron
+
+// Just enough of the Arduino environment to build the OTGWSerial library
+// on a Linux host
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <string>
+#include <algorithm>
+
+typedef uint8_t byte;
+
+using std::min;
+using std::max;
+
+// There is no separate flash address space
+#define PROGMEM
+#define PSTR(s) (s)
+#define F(s) (s)
+#define pgm_read_byte(p) (*(const uint8_t *)(p))
+#define pgm_read_word(p) (*(const uint16_t *)(p))
+#define pgm_read_ptr(p) (*(void * const *)(p))
+#define memcpy_P memcpy
+#define strcmp_P strcmp
+#define strstr_P strstr
+#define strlen_P strlen
+#define snprintf_P snprintf
+
+#define constrain(x, low, high) ((x) < (low) ? (low) : (x) > (high) ? (high) : (x))
+#define bitRead(value, bit) (((value) >> (bit)) & 1)
+#define bitSet(value, bit) ((value) |= (1UL << (bit)))
+#define bitClear(value, bit) ((value) &= ~(1UL << (bit)))
+
+#define LOW 0
+#define HIGH 1
+#define INPUT 0
+#define OUTPUT 1
+
+// Simulated time, advanced by the program using the library
+extern uint32_t hostmillis;
+inline uint32_t millis() {return hostmillis;}
+inline uint32_t micros() {return hostmillis * 1000;}
+inline void delay(unsigned long ms) {hostmillis += ms;}
+inline void yield() {}
+
+inline void pinMode(int pin, int mode) {}
+inline void digitalWrite(int pin, int value) {}
+
+class String : public std::string {
+public:
+   String(const char *s = "") : std::string(s) {}
+   String(const std::string &s) : std::string(s) {}
+};
@@ -0,0 +1,79 @@
+// Copyright (c) 2023 - Schelte Bron
+
+#pragma once
+
+#include <Arduino.h>
+#include <sys/stat.h>
+
+enum SeekMode {
+    SeekSet = SEEK_SET,
+    SeekCur = SEEK_CUR,
+    SeekEnd = SEEK_END
+};
+
+// File in a directory of the host that stands in for the file system
+class File {
+public:
+   File(FILE *fp = nullptr) : _fp(fp) {}
+   operator bool() const {return _fp != nullptr;}
+   void close() {
+       if (_fp) fclose(_fp);
+       _fp = nullptr;
+   }
+   void setTimeout(unsigned long timeout) {}
+   size_t size() {
+       struct stat st;
+       return fstat(fileno(_fp), &st) == 0 ? st.st_size : 0;
+   }
+   time_t getLastWrite() {
+       struct stat st;
+       return fstat(fileno(_fp), &st) == 0 ? st.st_mtime : 0;
+   }
+   int available() {return size() - ftell(_fp);}
+   bool seek(uint32_t pos, SeekMode mode) {return fseek(_fp, pos, mode) == 0;}
+   int read() {return fgetc(_fp);}
+   size_t read(uint8_t *buffer, size_t len) {return fread(buffer, 1, len, _fp);}
+   size_t readBytesUntil(char terminator, char *buffer, size_t len) {
+       size_t cnt = 0;
+       int ch;
+       while (cnt < len && (ch = fgetc(_fp)) != EOF && ch != terminator) {
+           buffer[cnt++] = ch;
+       }
+       return cnt;
+   }
+   size_t write(const uint8_t *buffer, size_t len) {
+       return fwrite(buffer, 1, len, _fp);
+   }
+   int printf(const char *fmt, ...) {
+       va_list ap;
+       va_start(ap, fmt);
+       int len = vfprintf(_fp, fmt, ap);
+       va_end(ap);
+       return len;
+   }
+protected:
+   FILE *_fp;
+};
+
+class FS {
+public:
+   // Directory that holds the files
+   std::string root = ".";
+
+   File open(const char *path, const char *mode) {
+       // Files opened for writing may also be read back
+       return File(fopen(fullpath(path).c_str(), *mode == 'w' ? "w+b" : "rb"));
+   }
+   bool exists(const char *path) {
+       struct stat st;
+       return stat(fullpath(path).c_str(), &st) == 0;
+   }
+   bool remove(const char *path) {
+       return ::remove(fullpath(path).c_str()) == 0;
+   }
+   bool rename(const char *from, const char *to) {
+       return ::rename(fullpath(from).c_str(), fullpath(to).c_str()) == 0;
+   }
+protected:
+   std::string fullpath(const char *path) {return root + "/" + path;}
+};
@@ -0,0 +1,35 @@
+// Copyright (c) 2023 - Schelte Bron
+
+#pragma once
+
+#include <Arduino.h>
+#include <deque>
+
+#define UART0 0
+#define SERIAL_8N1 0
+
+// Serial port of the host build. Bytes written by the library are
+// collected in tx. Whatever is put in rx is read back by the library.
+class HardwareSerial {
+public:
+   HardwareSerial(int uart) {}
+   void begin(unsigned long baud, int config) {}
+   int available() {return rx.size();}
+   int availableForWrite() {return 128;}
+   int read() {
+       if (rx.empty()) return -1;
+       int ch = rx.front();
+       rx.pop_front();
+       return ch;
+   }
+   size_t write(uint8_t c) {
+       tx.push_back(c);
+       return 1;
+   }
+   size_t write(const uint8_t *buffer, size_t len) {
+       tx.insert(tx.end(), buffer, buffer + len);
+       return len;
+   }
+
+   static std::deque<uint8_t> rx, tx;
+};
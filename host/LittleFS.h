@@ -0,0 +1,7 @@
+// Copyright (c) 2023 - Schelte Bron
+
+#pragma once
+
+#include <FS.h>
+
+extern FS LittleFS;
@@ -0,0 +1,9 @@
+// Copyright (c) 2023 - Schelte Bron
+
+#include <Arduino.h>
+#include <HardwareSerial.h>
+#include <LittleFS.h>
+
+uint32_t hostmillis = 0;
+std::deque<uint8_t> HardwareSerial::rx, HardwareSerial::tx;
+FS LittleFS;
@@ -0,0 +1,101 @@
+// Copyright (c) 2023 - Schelte Bron
+
+// Measure how fast Intel-HEX records are decoded. For comparison, the
+// records are also decoded the way it was done before, using sscanf().
+
+#include <Arduino.h>
+#include <OTGWSerial.h>
+#include <chrono>
+#include <vector>
+
+// Minimum time to spend on each measurement
+#define BENCHTIME 0.5
+
+typedef std::vector<std::string> Lines;
+
+static bool readlines(const char *path, Lines &lines) {
+    char buffer[80];
+    FILE *fp = fopen(path, "r");
+    if (fp == nullptr) return false;
+    lines.clear();
+    while (fgets(buffer, sizeof(buffer), fp)) {
+        buffer[strcspn(buffer, "\r\n")] = '\0';
+        if (*buffer) lines.push_back(buffer);
+    }
+    fclose(fp);
+    return true;
+}
+
+static OTGWError tabledecode(const char *line, OTGWHexRecord *rec) {
+    return hexDecode(line, rec);
+}
+
+// The previous implementation: sscanf() for the header and every byte
+static OTGWError scanfdecode(const char *line, OTGWHexRecord *rec) {
+    int len, addr, tag, data, i;
+    unsigned char sum = 0;
+
+    if (sscanf(line, ":%2x%4x%2x", &len, &addr, &tag) != 3) {
+        return OTGW_ERROR_HEX_FORMAT;
+    }
+    if (len > (int)sizeof(rec->data)) return OTGW_ERROR_HEX_DATASIZE;
+    for (i = 0; i < len + 5; i++) {
+        if (sscanf(line + 1 + 2 * i, "%02x", &data) != 1) {
+            return OTGW_ERROR_HEX_FORMAT;
+        }
+        if (i >= 4 && i < len + 4) rec->data[i - 4] = data;
+        sum += data;
+    }
+    if (sum != 0) return OTGW_ERROR_HEX_CHECKSUM;
+    rec->len = len;
+    rec->addr = addr;
+    rec->tag = tag;
+    return OTGW_ERROR_NONE;
+}
+
+// Returns the number of records decoded per second
+static double measure(const Lines &lines,
+  OTGWError (*decode)(const char *, OTGWHexRecord *)) {
+    using clock = std::chrono::steady_clock;
+    OTGWHexRecord rec;
+    unsigned long records = 0;
+    unsigned sum = 0;
+    double elapsed;
+
+    clock::time_point start = clock::now();
+    do {
+        for (const std::string &line : lines) {
+            if (decode(line.c_str(), &rec) != OTGW_ERROR_NONE) {
+                fprintf(stderr, "Decoding failed: %s\n", line.c_str());
+                return 0;
+            }
+            // Make sure the results are used
+            sum += rec.data[0];
+            records++;
+        }
+        elapsed = std::chrono::duration<double>(clock::now() - start).count();
+    } while (elapsed < BENCHTIME);
+    if (sum == 1) putchar(' ');
+    return records / elapsed;
+}
+
+int main(int argc, char **argv) {
+    Lines lines;
+
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s hexfile ...\n", argv[0]);
+        return 1;
+    }
+    printf("%-32s %8s %14s %14s\n", "file", "records", "table rec/s", "sscanf rec/s");
+    for (int i = 1; i < argc; i++) {
+        if (!readlines(argv[i], lines)) {
+            perror(argv[i]);
+            return 1;
+        }
+        double table = measure(lines, tabledecode);
+        double scanf = measure(lines, scanfdecode);
+        if (table == 0 || scanf == 0) return 1;
+        printf("%-32s %8zu %14.0f %14.0f\n", argv[i], lines.size(), table, scanf);
+    }
+    return 0;
+}
@@ -0,0 +1,76 @@
+# Copyright (c) 2023 - Schelte Bron
+
+# Convert the table of EEPROM settings locations (transfer.dat) into a
+# header file, so the table doesn't have to be parsed on the ESP8266.
+#
+# Usage: python3 mktransfer.py transfer.dat > transfer.h
+
+import sys
+import re
+import functools
+
+# Same as the maximum in OTGWSerial.cpp
+MAXID = 16
+
+# Compare two firmware versions the same way as versionCompare() does
+def compare(version1, version2):
+    s1 = re.findall(r'(\d+)(\D?)', version1)
+    s2 = re.findall(r'(\d+)(\D?)', version2)
+    for (v1, sep1), (v2, sep2) in zip(s1, s2):
+        if int(v1) != int(v2):
+            return -1 if int(v1) < int(v2) else 1
+        if sep1 != sep2:
+            # Alpha versions, beta versions, and subversions
+            for ch in ('a', 'b', ''):
+                if sep1 == ch:
+                    return -1
+                if sep2 == ch:
+                    return 1
+    return 0
+
+def main(path):
+    entries = []
+    with open(path) as f:
+        for line in f:
+            fields = line.split()
+            if len(fields) < 5 or not fields[0].isdigit():
+                continue
+            id, version = int(fields[0]), fields[1]
+            if id >= MAXID:
+                sys.exit('%s: id %d is too large' % (path, id))
+            entries.append((version, id, int(fields[2], 16),
+              int(fields[3]), int(fields[4], 16), ' '.join(fields[5:])))
+
+    # Sort by version and id. The sort is stable, so the file order is kept
+    # for entries that are otherwise equal.
+    entries.sort(key=lambda e: e[1])
+    entries.sort(key=functools.cmp_to_key(lambda a, b: compare(a[0], b[0])))
+    versions = []
+    for entry in entries:
+        if not versions or compare(versions[-1], entry[0]) != 0:
+            versions.append(entry[0])
+    width = max(len(v) for v in versions) + 1
+
+    print('// Generated from %s by mktransfer.py - do not edit' % path)
+    print()
+    print('#define XFER_VERSION_LEN %d' % width)
+    print('#define XFER_IDS %d' % (max(e[1] for e in entries) + 1))
+    print()
+    print('// Firmware versions that changed the locations, in ascending order')
+    print('const char xferversions[][XFER_VERSION_LEN] PROGMEM = {')
+    for version in versions:
+        print('    "%s",' % version)
+    print('};')
+    print()
+    print('// Locations of the settings, sorted by version and id')
+    print('const struct TransferEntry xfertable[] PROGMEM = {')
+    for version, id, addr, size, mask, name in entries:
+        index = next(i for i, v in enumerate(versions) if compare(v, version) == 0)
+        print('    {%2d, %2d, 0x%03x, %2d, 0x%02x},  // %s' %
+          (index, id, addr, size, mask, name))
+    print('};')
+
+if __name__ == '__main__':
+    if len(sys.argv) != 2:
+        sys.exit('Usage: %s transfer.dat' % sys.argv[0])
+    main(sys.argv[1])
@@ -0,0 +1,173 @@
+// Copyright (c) 2023 - Schelte Bron
+
+// Run PIC firmware upgrades against the simulated bootloader and report
+// how long they would take on a real gateway, how many retries were needed,
+// and whether the PIC ended up with the right program.
+
+#include <Arduino.h>
+#include <HardwareSerial.h>
+#include <LittleFS.h>
+#include <OTGWSerial.h>
+#include <filesystem>
+#include <unistd.h>
+#include "picsim.h"
+
+namespace fs = std::filesystem;
+
+// Give up on an upgrade after this much simulated time (ms)
+#define TIMELIMIT (30 * 60 * 1000)
+
+// Start-up messages of the firmware types, as matched by OTGWSerial
+static const char *banners[] = {
+    "OpenTherm Gateway ",
+    "Opentherm gateway diagnostics - Version ",
+    "OpenTherm Interface "
+};
+
+static bool finished;
+static OTGWError result;
+static short errors, retries;
+static OTGWUpgradeStats stats;
+
+static void upgradedone(OTGWError rc, short errcnt, short retrycnt,
+  const OTGWUpgradeStats *st) {
+    finished = true;
+    result = rc;
+    errors = errcnt;
+    retries = retrycnt;
+    if (st) stats = *st; else memset(&stats, 0, sizeof(stats));
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-l loss] [-c corrupt] [-s seed] "
+      "[-i initial.hex] [-n] hexfile ...\n", prog);
+    exit(1);
+}
+
+// The banner the initial firmware prints when it starts, so the library
+// knows which firmware the PIC runs
+static bool initialbanner(const char *hexfile, std::string &banner) {
+    OTGWHexCheck check;
+    uint8_t buffer[256];
+    size_t n;
+    FILE *fp = fopen(hexfile, "rb");
+
+    if (fp == nullptr) return false;
+    while ((n = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
+        if (check.feed(buffer, n) != OTGW_ERROR_NONE) break;
+    }
+    fclose(fp);
+    if (check.finish() != OTGW_ERROR_NONE) return false;
+    if (check.firmware() < FIRMWARE_COUNT && *check.version()) {
+        banner = std::string(banners[check.firmware()]) + check.version() + "\r\n";
+    }
+    return true;
+}
+
+// The directory of the hex file indicates the PIC model
+static bool picmodel(const fs::path &hexfile, OTGWProcessor *model) {
+    std::string dir = hexfile.parent_path().filename().string();
+    if (dir == "pic16f88") {
+        *model = PIC16F88;
+    } else if (dir == "pic16f1847") {
+        *model = PIC16F1847;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    double loss = 0, corrupt = 0;
+    uint32_t seed = 1;
+    const char *initial = nullptr;
+    std::string banner;
+    bool differential = true;
+    int opt, failures = 0;
+
+    while ((opt = getopt(argc, argv, "l:c:s:i:n")) != -1) {
+        switch (opt) {
+         case 'l': loss = atof(optarg); break;
+         case 'c': corrupt = atof(optarg); break;
+         case 's': seed = strtoul(optarg, nullptr, 0); break;
+         case 'i': initial = optarg; break;
+         case 'n': differential = false; break;
+         default: usage(argv[0]);
+        }
+    }
+    if (optind >= argc) usage(argv[0]);
+    if (initial && !initialbanner(initial, banner)) {
+        fprintf(stderr, "%s: invalid hex file\n", initial);
+        return 1;
+    }
+
+    // Scratch directory standing in for the file system
+    char tmpl[] = "/tmp/picbenchXXXXXX";
+    if (mkdtemp(tmpl) == nullptr) {
+        perror("mkdtemp");
+        return 1;
+    }
+    LittleFS.root = tmpl;
+
+    printf("Byte loss %g, corruption %g, seed %u\n", loss, corrupt, seed);
+    printf("%-32s %-7s %6s %9s %5s %7s %8s %6s %s\n", "file", "PIC",
+      "result", "time (s)", "cmds", "retries", "timeouts", "errors", "program");
+    for (int i = optind; i < argc; i++) {
+        fs::path hexfile = argv[i];
+        OTGWProcessor model;
+        if (!picmodel(hexfile, &model)) {
+            fprintf(stderr, "%s: not in a pic16f88 or pic16f1847 directory\n", argv[i]);
+            failures++;
+            continue;
+        }
+        std::string dir = hexfile.parent_path().filename().string();
+        std::string name = "/" + dir + "/" + hexfile.filename().string();
+        fs::create_directories(fs::path(tmpl) / dir);
+        fs::copy_file(hexfile, fs::path(tmpl) / dir / hexfile.filename(),
+          fs::copy_options::overwrite_existing);
+
+        PicSim pic(model), expect(model);
+        if (initial && !pic.load(initial)) {
+            fprintf(stderr, "%s: cannot load\n", initial);
+            return 1;
+        }
+        expect.load(argv[i]);
+
+        HardwareSerial::rx.clear();
+        HardwareSerial::tx.clear();
+        hostmillis = 0;
+        OTGWSerial Pic;
+        Pic.registerFinishedCallback(upgradedone);
+        Pic.differentialUpgrade(differential);
+        // The running firmware announces itself
+        HardwareSerial::rx.assign(banner.begin(), banner.end());
+        while (Pic.read() >= 0);
+        // Connect the line only after the constructor reset the PIC
+        HardwareSerial::tx.clear();
+        pic.errors(loss, corrupt, seed);
+
+        finished = false;
+        uint64_t start = 0, now = 0;
+        OTGWError rc = Pic.startUpgrade(name.c_str());
+        if (rc != OTGW_ERROR_NONE) {
+            upgradedone(rc, 0, 0, nullptr);
+        }
+        while (!finished && hostmillis < TIMELIMIT) {
+            pic.run(now);
+            Pic.available();
+            now += 1000;
+            hostmillis = now / 1000;
+        }
+        if (!finished) result = OTGW_ERROR_INPROG;
+        bool match = !pic.codeDiffers(expect);
+        if (result != OTGW_ERROR_NONE || !match) failures++;
+        printf("%-32s %-7s %6d %9.1f %5lu %7d %8u %6d %s\n",
+          argv[i], pic.name(), result, (now - start) / 1e6, pic.commands,
+          retries, stats.timeouts, errors, match ? "ok" : "DIFFERS");
+        if (pic.lost || pic.corrupted) {
+            printf("%32s %lu bytes lost, %lu corrupted\n", "", pic.lost, pic.corrupted);
+        }
+    }
+    fs::remove_all(tmpl);
+    return failures != 0;
+}
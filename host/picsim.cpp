@@ -0,0 +1,254 @@
+// Copyright (c) 2023 - Schelte Bron
+
+#include <HardwareSerial.h>
+#include "picsim.h"
+
+#define STX 0x0f
+#define ETX 0x04
+#define DLE 0x05
+
+enum {
+    CMD_VERSION,
+    CMD_READPROG,
+    CMD_WRITEPROG,
+    CMD_ERASEPROG,
+    CMD_READDATA,
+    CMD_WRITEDATA,
+    CMD_READCFG,
+    CMD_WRITECFG,
+    CMD_RESET
+};
+
+// Properties of the simulated PICs. The durations (us) are the typical
+// values from the data sheets.
+struct PicSimModel {
+    const char *name;
+    byte id;
+    unsigned short codesize, eebase;
+    // Program memory occupied by the bootloader
+    unsigned short protectstart, protectend;
+    // Words programmed in one go and the time that takes
+    unsigned short writesize, writetime;
+    unsigned short erasetime, eewritetime;
+};
+
+static const PicSimModel models[] = {
+    {"16F88", 1, 4096, 0x2100, 0x0f00, 0x0fff, 4, 2000, 2000, 4000},
+    {"16F1847", 2, 8192, 0xf000, 0x1f00, 0x1fff, 32, 2500, 2500, 5000}
+};
+
+// Start-up time of the bootloader after a reset
+#define BOOTTIME 20000
+// Time needed to process a command, apart from programming the memory
+#define CMDTIME 100
+
+PicSim::PicSim(OTGWProcessor model)
+  : info(models + (model == PIC16F1847)), boot(false), dle(false),
+    txfree(0), rxfree(0), loss(0), corrupt(0), random(1) {
+    for (auto &word : code) word = 0x3fff;
+    memset(loaded, 0, sizeof(loaded));
+    memset(data, 0xff, sizeof(data));
+    commands = lost = corrupted = 0;
+}
+
+const char *PicSim::name() const {
+    return info->name;
+}
+
+bool PicSim::load(const char *hexfile) {
+    char line[80];
+    OTGWHexRecord rec;
+    unsigned int addr, seg = 0;
+    FILE *fp = fopen(hexfile, "r");
+
+    if (fp == nullptr) return false;
+    while (fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (hexDecode(line, &rec) != OTGW_ERROR_NONE) {
+            fclose(fp);
+            return false;
+        }
+        if (rec.tag == 2 || rec.tag == 4) {
+            seg = rec.data[0] << 8 | rec.data[1];
+            if (rec.tag == 4) seg <<= 12;
+        } else if (rec.tag == 0) {
+            addr = (rec.addr >> 1) + (seg << 3);
+            for (int i = 0; i < rec.len / 2; i++, addr++) {
+                unsigned short word = rec.data[2 * i] | rec.data[2 * i + 1] << 8;
+                if (addr < info->codesize) {
+                    code[addr] = word & 0x3fff;
+                    loaded[addr] = true;
+                } else if (addr >= info->eebase && addr < info->eebase + 256u) {
+                    data[addr - info->eebase] = word;
+                }
+            }
+        }
+    }
+    fclose(fp);
+    return true;
+}
+
+void PicSim::errors(double loss, double corrupt, uint32_t seed) {
+    this->loss = loss;
+    this->corrupt = corrupt;
+    random = seed ? seed : 1;
+}
+
+bool PicSim::protect(unsigned int addr) const {
+    return addr >= info->protectstart && addr <= info->protectend;
+}
+
+bool PicSim::codeDiffers(const PicSim &pic) const {
+    for (unsigned int addr = 0; addr < info->codesize; addr++) {
+        if (pic.loaded[addr] && !protect(addr) && code[addr] != pic.code[addr]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Apply the line errors to a byte. Returns false if the byte got lost.
+bool PicSim::transfer(uint8_t &ch) {
+    // xorshift32, to get the same results on every host
+    auto chance = [this]() {
+        random ^= random << 13;
+        random ^= random >> 17;
+        random ^= random << 5;
+        return random / 4294967296.0;
+    };
+    if (loss > 0 && chance() < loss) {
+        lost++;
+        return false;
+    }
+    if (corrupt > 0 && chance() < corrupt) {
+        corrupted++;
+        ch ^= 1 << (random & 7);
+    }
+    return true;
+}
+
+void PicSim::run(uint64_t t) {
+    // Bytes written by the library since the last call start going out now
+    for (uint8_t ch : HardwareSerial::tx) {
+        txfree = max(t, txfree) + PICSIM_BYTETIME;
+        inbound.push_back({txfree, ch});
+    }
+    HardwareSerial::tx.clear();
+
+    while (!inbound.empty() && inbound.front().time <= t) {
+        Byte b = inbound.front();
+        inbound.pop_front();
+        if (transfer(b.ch)) receive(b.time, b.ch);
+    }
+
+    while (!outbound.empty() && outbound.front().time <= t) {
+        Byte b = outbound.front();
+        outbound.pop_front();
+        if (transfer(b.ch)) HardwareSerial::rx.push_back(b.ch);
+    }
+}
+
+void PicSim::receive(uint64_t t, uint8_t ch) {
+    if (!boot) {
+        // The gateway firmware resets the PIC on the GW=R command
+        app += ch;
+        if (app.size() > 5) app.erase(0, app.size() - 5);
+        if (app == "GW=R\r") {
+            boot = true;
+            app.clear();
+            // The bootloader announces itself with an empty packet
+            reply(t + BOOTTIME, {});
+        }
+    } else if (dle) {
+        packet.push_back(ch);
+        dle = false;
+    } else if (ch == STX) {
+        packet.clear();
+    } else if (ch == DLE) {
+        dle = true;
+    } else if (ch == ETX) {
+        execute(t);
+        packet.clear();
+    } else {
+        packet.push_back(ch);
+    }
+}
+
+void PicSim::execute(uint64_t t) {
+    uint8_t sum = 0;
+    unsigned int i, len, addr;
+
+    commands++;
+    for (uint8_t ch : packet) sum += ch;
+    // Packets with a bad checksum are ignored
+    if (packet.size() < 3 || sum != 0) return;
+    packet.pop_back();
+    len = packet[1];
+    addr = packet.size() >= 4 ? packet[2] | packet[3] << 8 : 0;
+
+    std::vector<uint8_t> r(packet.begin(), packet.begin() + min<size_t>(4, packet.size()));
+    t += CMDTIME;
+    switch (packet[0]) {
+     case CMD_VERSION:
+        r = {CMD_VERSION, 3, 0, info->id,
+          (uint8_t)(info->protectstart & 0xff), (uint8_t)(info->protectstart >> 8),
+          (uint8_t)(info->protectend & 0xff), (uint8_t)(info->protectend >> 8)};
+        break;
+     case CMD_READPROG:
+        for (i = 0; i < len; i++) {
+            unsigned short word = code[(addr + i) % info->codesize];
+            r.push_back(word & 0xff);
+            r.push_back(word >> 8);
+        }
+        break;
+     case CMD_WRITEPROG:
+        // The 16F88 counts blocks of 4 words, the 16F1847 counts words
+        if (info->writesize == 4) len *= 4;
+        if (packet.size() < 4 + 2 * len) return;
+        for (i = 0; i < len; i++) {
+            if (protect(addr + i) || addr + i >= info->codesize) continue;
+            code[addr + i] = (packet[4 + 2 * i] | packet[5 + 2 * i] << 8) & 0x3fff;
+        }
+        t += (len + info->writesize - 1) / info->writesize * info->writetime;
+        break;
+     case CMD_ERASEPROG:
+        for (i = 0; i < 32 * len; i++) {
+            if (protect(addr + i) || addr + i >= info->codesize) continue;
+            code[addr + i] = 0x3fff;
+        }
+        t += len * info->erasetime;
+        break;
+     case CMD_READDATA:
+        for (i = 0; i < len; i++) r.push_back(data[(addr + i) & 0xff]);
+        break;
+     case CMD_WRITEDATA:
+        if (packet.size() < 4 + len) return;
+        for (i = 0; i < len; i++) data[(addr + i) & 0xff] = packet[4 + i];
+        t += len * info->eewritetime;
+        break;
+     case CMD_RESET:
+        // Start the firmware
+        boot = false;
+        return;
+    }
+    reply(t, r);
+}
+
+void PicSim::reply(uint64_t t, const std::vector<uint8_t> &packet) {
+    std::vector<uint8_t> bytes = {STX};
+    uint8_t sum = 0;
+
+    for (size_t i = 0; i <= packet.size(); i++) {
+        uint8_t ch = i < packet.size() ? packet[i] : sum;
+        if (ch == STX || ch == ETX || ch == DLE) bytes.push_back(DLE);
+        bytes.push_back(ch);
+        sum -= ch;
+    }
+    // The announcement after a reset doesn't have a checksum
+    if (packet.empty()) bytes.resize(1);
+    bytes.push_back(ETX);
+    for (uint8_t ch : bytes) {
+        rxfree = max(t, rxfree) + PICSIM_BYTETIME;
+        outbound.push_back({rxfree, ch});
+    }
+}
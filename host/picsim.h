@@ -0,0 +1,63 @@
+// Copyright (c) 2023 - Schelte Bron
+
+// Simulation of the PIC bootloader on the other side of the serial port of
+// the host build. Bytes travel over a virtual 9600 baud line in both
+// directions, where they can be lost or corrupted on purpose.
+
+#pragma once
+
+#include <Arduino.h>
+#include <OTGWSerial.h>
+#include <deque>
+#include <vector>
+
+// Time to transfer one byte (start bit, 8 data bits, stop bit) in us
+#define PICSIM_BYTETIME (10 * 1000000 / 9600)
+
+struct PicSimModel;
+
+class PicSim {
+public:
+   PicSim(OTGWProcessor model);
+   // Program the memory from a hex file, like a PIC programmer would
+   bool load(const char *hexfile);
+   // Probabilities of a byte getting lost or corrupted on the line
+   void errors(double loss, double corrupt, uint32_t seed = 1);
+   // Handle everything that happens on the line up to time t (us)
+   void run(uint64_t t);
+   // Program memory outside of the bootloader differs from the words that
+   // were loaded into another PIC. Rows the firmware doesn't use are not
+   // compared, because they may still hold the fail safe code.
+   bool codeDiffers(const PicSim &pic) const;
+   const char *name() const;
+
+   unsigned short code[8192];
+   byte data[256];
+   // Program memory words that were set by load()
+   bool loaded[8192];
+   // Statistics
+   unsigned long commands, lost, corrupted;
+
+protected:
+   struct Byte {
+       uint64_t time;
+       uint8_t ch;
+   };
+
+   bool transfer(uint8_t &ch);
+   void receive(uint64_t t, uint8_t ch);
+   void execute(uint64_t t);
+   void reply(uint64_t t, const std::vector<uint8_t> &packet);
+   bool protect(unsigned int addr) const;
+
+   const PicSimModel *info;
+   bool boot, dle;
+   std::string app;
+   std::vector<uint8_t> packet;
+   // Bytes on their way to the PIC and from the PIC
+   std::deque<Byte> inbound, outbound;
+   // Time when the line in each direction becomes available
+   uint64_t txfree, rxfree;
+   double loss, corrupt;
+   uint32_t random;
+};
@@ -0,0 +1,98 @@
+// Copyright (c) 2023 - Schelte Bron
+
+// Check the compiled table of EEPROM settings locations against the text
+// file it was generated from. The locations are determined for every
+// version mentioned in the file, and for a number of other versions.
+
+#include <Arduino.h>
+#include <OTGWSerial.h>
+#include <vector>
+
+#define MAXID 16
+
+// Versions that don't appear in transfer.dat
+static const char *extra[] = {
+    "2.0", "4.0", "4.0a5", "4.0a9.2", "4.0b5", "4.0.1", "4.2", "4.2.7.1",
+    "5.0", "5.8", "6.1", "6.5", "7.0"
+};
+
+struct Line {
+    std::string version;
+    int id, addr, size, mask;
+};
+
+static bool readfile(const char *path, std::vector<Line> &lines) {
+    char buffer[80], version[16];
+    Line line;
+    FILE *fp = fopen(path, "r");
+    if (fp == nullptr) return false;
+    while (fgets(buffer, sizeof(buffer), fp)) {
+        if (sscanf(buffer, "%d %15s %x %d %x", &line.id, version,
+          &line.addr, &line.size, &line.mask) == 5) {
+            line.version = version;
+            lines.push_back(line);
+        }
+    }
+    fclose(fp);
+    return true;
+}
+
+// The way the text file used to be processed: Every line that applies
+// to the version overrides the earlier ones
+static int reference(const std::vector<Line> &lines, const char *version,
+  OTGWTransferData *xfer) {
+    int last = 0;
+    for (const Line &line : lines) {
+        if (versionCompare(version, line.version.c_str()) < 0) continue;
+        xfer[line.id].addr = line.addr;
+        xfer[line.id].size = line.size;
+        xfer[line.id].mask = line.mask;
+        if (line.id > last) last = line.id;
+    }
+    return last;
+}
+
+static bool check(const std::vector<Line> &lines, const char *version) {
+    OTGWTransferData xfer1[MAXID] = {}, xfer2[MAXID] = {};
+    int last1, last2;
+    bool ok = true;
+
+    last1 = reference(lines, version, xfer1);
+    last2 = eepromSettings(version, xfer2);
+    if (last1 != last2) ok = false;
+    printf("%-10s", version);
+    for (int i = 0; i <= last1; i++) {
+        if (xfer1[i].addr != xfer2[i].addr || xfer1[i].size != xfer2[i].size
+          || xfer1[i].mask != xfer2[i].mask) {
+            ok = false;
+        }
+        if (xfer1[i].size) {
+            printf(" %d:%02x/%d", i, xfer1[i].addr, xfer1[i].size);
+        }
+    }
+    printf("%s\n", ok ? "" : "  MISMATCH");
+    return ok;
+}
+
+int main(int argc, char **argv) {
+    std::vector<Line> lines;
+    int errors = 0;
+
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s transfer.dat\n", argv[0]);
+        return 1;
+    }
+    if (!readfile(argv[1], lines)) {
+        perror(argv[1]);
+        return 1;
+    }
+    for (size_t i = 0; i < lines.size(); i++) {
+        if (i > 0 && lines[i].version == lines[i - 1].version) continue;
+        if (!check(lines, lines[i].version.c_str())) errors++;
+    }
+    for (const char *version : extra) {
+        if (!check(lines, version)) errors++;
+    }
+    printf("%d mismatches\n", errors);
+    return errors != 0;
+}
@@ -33,6 +33,53 @@
 
 #define XFER_MAX_ID 16
 
+// Location of a setting in data memory, from a specific firmware version on
+struct TransferEntry {
+    byte version, id;
+    unsigned short addr;
+    byte size, mask;
+};
+
+// The table is generated from data/transfer.dat with host/mktransfer.py
+#include "transfer.h"
+
+static_assert(XFER_IDS <= XFER_MAX_ID, "Too many settings in transfer.dat");
+
+// Progress of an upgrade, to be able to continue after an interruption
+#define CHECKPOINT "/upgrade.chk"
+// Rows of program memory between checkpoints
+#define CHECKPOINT_ROWS 8
+
+// Preparsed firmware image, stored beside the hex file. The header is
+// followed by the data memory contents, a bitmap of the data memory
+// addresses used by the firmware, and the rows of program memory, each
+// preceded by its address.
+#define IMAGE_MAGIC 0x3149474f  // "OGI1"
+#define IMAGE_SUFFIX ".img"
+// A backup is collected in a temporary file until it is complete
+#define BACKUP_TMP "/backup.tmp"
+// A settings profile is written next to the old one first
+#define SETTINGS_TMP ".tmp"
+
+// Settings profile: the header is followed by the data memory contents
+#define SETTINGS_MAGIC 0x3153474f  // "OGS1"
+
+struct SettingsHeader {
+    uint32_t magic;
+    byte model, reserved[3];
+    // Gateway firmware version the settings belong to
+    char version[16];
+};
+
+struct ImageHeader {
+    uint32_t magic;
+    // Identification of the hex file the image was created from
+    uint32_t hexsize, hexdate;
+    uint32_t imagehash;
+    uint16_t rows, weight;
+    byte model, reserved[3];
+};
+
 // Relative duration of each programming operation (each unit is actually about 21ms)
 #define WEIGHT_RESET    8
 #define WEIGHT_VERSION  1
@@ -41,7 +88,14 @@
 #define WEIGHT_DATAPROG 20
 #define WEIGHT_MAXIMUM  2000
 
-#define byteswap(val) (((val << 8) | (val >> 8)) & 0xffff)
+// Timeouts waiting for a reply from the bootloader (ms)
+#define TIMEOUT_INITIAL 1000    // Until a round trip time has been measured
+#define TIMEOUT_MIN     100
+#define TIMEOUT_MAX     4000
+// Minimum allowance for variations in the round trip time
+#define TIMEOUT_MARGIN  50
+// Doublings of the timeout after consecutive timeouts
+#define BACKOFF_MAX     3
 
 #ifdef DEBUG
 #define Dprintf(...) if (debugfunc) debugfunc(__VA_ARGS__)
@@ -53,8 +107,25 @@ OTGWDebugFunction *debugfunc = nullptr;
 static OTGWFirmware firmware = FIRMWARE_UNKNOWN;
 static char fwversion[16];
 
-const char hexbytefmt[] = "%02x";
-const char hexwordfmt[] = "%04x";
+// Value of each hexadecimal digit, 0xff for all other characters
+const byte hexdigits[256] PROGMEM = {
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+      0,   1,   2,   3,   4,   5,   6,   7,   8,   9, 255, 255, 255, 255, 255, 255,
+    255,  10,  11,  12,  13,  14,  15, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+    255,  10,  11,  12,  13,  14,  15, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255
+};
 
 enum {
     FWSTATE_IDLE,
@@ -63,7 +134,17 @@ enum {
     FWSTATE_DUMP,
     FWSTATE_PREP,
     FWSTATE_CODE,
-    FWSTATE_DATA
+    FWSTATE_DATA,
+    FWSTATE_VERIFY,
+    FWSTATE_BACKUP
+};
+
+enum {
+    MODE_UPGRADE,
+    MODE_VERIFY,
+    MODE_BACKUP,
+    MODE_SAVESETTINGS,
+    MODE_LOADSETTINGS
 };
 
 enum {
@@ -102,7 +183,7 @@ const byte newpic[] = {6, 2, 2};
 unsigned short p16f88recover(unsigned short addr, unsigned short *code) {
     unsigned short cnt = 0;
     code[cnt++] = addr & 0x800 ? 0x158a : 0x118a;   // pagesel SelfProg
-    code[cnt++] = 0x2000 | addr & 0x7ff;            // call    SelfProg
+    code[cnt++] = 0x2000 | (addr & 0x7ff);            // call    SelfProg
     code[cnt++] = 0x118a;                           // pagesel 0x0000
     code[cnt++] = 0x2820;                           // goto    0x0020
     return cnt;
@@ -111,18 +192,156 @@ unsigned short p16f88recover(unsigned short addr, unsigned short *code) {
 unsigned short p16f1847recover(unsigned short addr, unsigned short *code) {
     unsigned short cnt = 0;
     code[cnt++] = 0x3180 | addr >> 8;               // pagesel SelfProg
-    code[cnt++] = 0x2000 | addr & 0x7ff;            // call    SelfProg
+    code[cnt++] = 0x2000 | (addr & 0x7ff);            // call    SelfProg
     code[cnt++] = 0x3180;                           // pagesel 0x0000
     code[cnt++] = 0x2820;                           // goto    0x0020
     return cnt;
 }
 
+// Convert two hexadecimal digits. Returns -1 if either is not a hex digit.
+static inline int hexbyte(const char *s) {
+    byte hi, lo;
+    hi = pgm_read_byte(hexdigits + (byte)s[0]);
+    if (hi > 15) return -1;
+    lo = pgm_read_byte(hexdigits + (byte)s[1]);
+    if (lo > 15) return -1;
+    return hi << 4 | lo;
+}
+
+// Decode a line of an Intel-HEX file in a single pass, checking the
+// checksum along the way
+OTGWError hexDecode(const char *line, OTGWHexRecord *rec) {
+    const char *s = line;
+    byte hdr[4], sum = 0;
+    int i, len, val;
+
+    if (*s++ != ':') return OTGW_ERROR_HEX_FORMAT;
+    // Byte count, address, and record type
+    for (i = 0; i < 4; i++, s += 2) {
+        if ((val = hexbyte(s)) < 0) return OTGW_ERROR_HEX_FORMAT;
+        hdr[i] = val;
+        sum += val;
+    }
+    len = hdr[0];
+    if (len > (int)sizeof(rec->data)) return OTGW_ERROR_HEX_DATASIZE;
+    rec->len = len;
+    rec->addr = hdr[1] << 8 | hdr[2];
+    rec->tag = hdr[3];
+    // Data bytes, followed by the checksum
+    for (i = 0; i <= len; i++, s += 2) {
+        if ((val = hexbyte(s)) < 0) return OTGW_ERROR_HEX_FORMAT;
+        sum += val;
+        if (i < len) rec->data[i] = val;
+    }
+    // Allow a carriage return, or other white space
+    while (isspace(*s)) s++;
+    if (*s != '\0') return OTGW_ERROR_HEX_FORMAT;
+    if (sum != 0) return OTGW_ERROR_HEX_CHECKSUM;
+    return OTGW_ERROR_NONE;
+}
+
+bool OTGWFileSource::open(const char *path) {
+    _file = LittleFS.open(path, "r");
+    if (!_file) return false;
+    _file.setTimeout(0);
+    return true;
+}
+
+void OTGWFileSource::close() {
+    if (_file) _file.close();
+}
+
+int OTGWFileSource::readLine(char *buffer, int size) {
+    int len = _file.readBytesUntil('\n', buffer, size - 1);
+    buffer[len] = '\0';
+    return len;
+}
+
+bool OTGWFileSource::rewind() {
+    return _file.seek(0, SeekSet);
+}
+
+OTGWStreamSource::OTGWStreamSource(size_t size)
+  : _size(size), _head(0), _fill(0), _lines(0), _ended(false), _failed(false) {
+    _buffer = new uint8_t[size];
+    if (_buffer == nullptr) _size = 0;
+}
+
+OTGWStreamSource::~OTGWStreamSource() {
+    delete[] _buffer;
+}
+
+size_t OTGWStreamSource::write(const uint8_t *data, size_t len) {
+    size_t cnt = 0;
+    if (_ended) return 0;
+    while (cnt < len && _fill < _size) {
+        uint8_t ch = data[cnt++];
+        _buffer[(_head + _fill++) % _size] = ch;
+        if (ch == '\n') _lines++;
+    }
+    return cnt;
+}
+
+int OTGWStreamSource::readLine(char *buffer, int size) {
+    int len = 0;
+    if (_failed) return 0;
+    if (_lines == 0) {
+        // Without a line ending, the line may still be incomplete
+        if (!_ended) {
+            // A line that doesn't fit in the queue will never complete
+            if (_fill < _size) return -1;
+            _failed = true;
+            return 0;
+        }
+        // The last line doesn't have to be terminated
+        _lines++;
+    }
+    while (_fill > 0) {
+        uint8_t ch = _buffer[_head];
+        _head = (_head + 1) % _size;
+        _fill--;
+        if (ch == '\n') break;
+        // Silently truncate overly long lines
+        if (len < size - 1) buffer[len++] = ch;
+    }
+    _lines--;
+    buffer[len] = '\0';
+    return len;
+}
+
 OTGWUpgrade::OTGWUpgrade(OTGWSerial *serial)
-  : serial(serial), stage(FWSTATE_IDLE) {
+  : serial(serial), stage(FWSTATE_IDLE), source(&hexfd), hexeof(false),
+    rowbusy(false), streaming(false), starved(false),
+    newfirmware(FIRMWARE_UNKNOWN), differential(false), probing(false),
+    dumped(false), misses(0), resume(0), imaged(false), mode(MODE_UPGRADE),
+    pending(OTGW_CMD_RESET), backoff(0), ambiguous(false), sent(0),
+    timeout(TIMEOUT_INITIAL), started(millis()) {
+    oldversion[0] = '\0';
+    memset(rtt, 0, sizeof(rtt));
 }
 
 OTGWUpgrade::~OTGWUpgrade() {
-    if (hexfd) hexfd.close();
+}
+
+// Program the PIC from hex data that becomes available while the upgrade
+// is running. The first data record determines the target PIC.
+OTGWError OTGWUpgrade::start(OTGWUpgradeSource *source) {
+    this->source = source;
+    streaming = true;
+    model = PICUNKNOWN;
+    memset(datamem, -1, 256 * sizeof(char));
+    memset(eedata, -1, 256 * sizeof(char));
+    memset(eeused, 0, sizeof(eeused));
+    version = nullptr;
+    hexseg = 0;
+    hexaddr = 0;
+    hexnext = 0;
+    hexpos = 0;
+    hexlen = 0;
+    total = WEIGHT_MAXIMUM;
+    done = 0;
+    streamStart();
+    return OTGW_ERROR_NONE;
 }
 
 OTGWError OTGWUpgrade::start(const char *hexfile) {
@@ -142,6 +361,77 @@ OTGWError OTGWUpgrade::start(const char *hexfile) {
     return OTGW_ERROR_NONE;
 }
 
+// Read back the PIC memory and report the differences with the firmware
+OTGWError OTGWUpgrade::verify(const char *hexfile) {
+    mode = MODE_VERIFY;
+    return start(hexfile);
+}
+
+// Save the contents of the PIC program and data memory in an image file
+OTGWError OTGWUpgrade::backup(const char *imgfile) {
+    if (strlen(imgfile) >= sizeof(filepath)) {
+        return finishUpgrade(OTGW_ERROR_HEX_ACCESS);
+    }
+    imgfd = LittleFS.open(BACKUP_TMP, "w");
+    if (!imgfd) return finishUpgrade(OTGW_ERROR_HEX_ACCESS);
+    strcpy(filepath, imgfile);
+    mode = MODE_BACKUP;
+    total = WEIGHT_MAXIMUM;
+    stateMachine();
+    return OTGW_ERROR_NONE;
+}
+
+// Program the PIC with an image file created by backup()
+OTGWError OTGWUpgrade::restore(const char *imgfile) {
+    if (!loadImage(imgfile, true)) return finishUpgrade(OTGW_ERROR_HEX_ACCESS);
+    // The backup contains the settings, so don't transfer the current ones
+    version = nullptr;
+    stateMachine();
+    return OTGW_ERROR_NONE;
+}
+
+// Store the gateway settings from the PIC data memory in a profile
+OTGWError OTGWUpgrade::saveSettings(const char *path) {
+    if (strlen(path) >= sizeof(filepath)) {
+        return finishUpgrade(OTGW_ERROR_HEX_ACCESS);
+    }
+    strcpy(filepath, path);
+    mode = MODE_SAVESETTINGS;
+    total = WEIGHT_RESET + WEIGHT_VERSION + 4 * WEIGHT_DATAREAD;
+    stateMachine();
+    return OTGW_ERROR_NONE;
+}
+
+// Put the settings from a profile back into the PIC data memory, without
+// reprogramming the firmware
+OTGWError OTGWUpgrade::loadSettings(const char *path) {
+    struct SettingsHeader hdr;
+
+    if (strlen(path) >= sizeof(filepath)) {
+        return finishUpgrade(OTGW_ERROR_HEX_ACCESS);
+    }
+    File f = LittleFS.open(path, "r");
+    if (!f) return finishUpgrade(OTGW_ERROR_HEX_ACCESS);
+    if (f.read((uint8_t *)&hdr, sizeof(hdr)) != sizeof(hdr)
+      || hdr.magic != SETTINGS_MAGIC || hdr.model >= PICCOUNT
+      || f.size() != sizeof(hdr) + 256) {
+        f.close();
+        return finishUpgrade(OTGW_ERROR_MAGIC);
+    }
+    f.close();
+    strcpy(filepath, path);
+    mode = MODE_LOADSETTINGS;
+    model = hdr.model;
+    memcpy_P(&info, PicInfo + model, sizeof(struct PicInfo));
+    memcpy(oldversion, hdr.version, sizeof(oldversion));
+    oldversion[sizeof(oldversion) - 1] = '\0';
+    // Writing all data memory is the worst case
+    total = WEIGHT_RESET + WEIGHT_VERSION + 4 * WEIGHT_DATAREAD
+      + info.datasize / 64 * WEIGHT_DATAPROG;
+    stateMachine();
+    return OTGW_ERROR_NONE;
+}
+
 // Inform the parent object about the upgrade progress
 void OTGWUpgrade::progress(int weight) {
     done += weight;
@@ -150,72 +440,189 @@ void OTGWUpgrade::progress(int weight) {
     serial->progress(done * 100 / total);
 }
 
-unsigned char OTGWUpgrade::hexChecksum(char *hex, int len) {
-    unsigned char sum = 0;
-    int val;
-
-    while (len-- > 0) {
-        sscanf(hex, hexbytefmt, &val);
-        sum -= val;
-        hex += 2;
-    }
-    return sum;
-}
-
 OTGWError OTGWUpgrade::readHexRecord() {
     char hexbuf[48];
-    int len, addr, tag, data, offs, i;
-    while (hexfd.readBytesUntil('\n', hexbuf, sizeof(hexbuf)) != 0) {
-        if (sscanf(hexbuf, ":%2x%4x%2x", &len, &addr, &tag) != 3) break;
-        if (len & 1) {
+    OTGWHexRecord rec;
+    OTGWError rc;
+    int i, n;
+    if (hexeof) {
+        // Nothing more to read
+        hexlen = 0;
+        return OTGW_ERROR_NONE;
+    }
+    while ((n = source->readLine(hexbuf, sizeof(hexbuf))) > 0) {
+        rc = hexDecode(hexbuf, &rec);
+        if (rc == OTGW_ERROR_HEX_FORMAT) break;
+        if (rc != OTGW_ERROR_NONE) return rc;
+        if (rec.len & 1) {
             // Invalid data size
             return OTGW_ERROR_HEX_DATASIZE;
         }
-        if (hexChecksum(hexbuf + 1, len + 5) != 0) {
-            // Checksum error
-            return OTGW_ERROR_HEX_CHECKSUM;
-        }
-        offs = 9;
-        if (tag == 0) {
+        if (rec.tag == 0) {
             // Data record
-            hexaddr = (addr >> 1) + (hexseg << 3);
-            len >>= 1;
-            hexlen = len;
-            for (i = 0; i < len; i++) {
-                if (sscanf(hexbuf + offs, hexwordfmt, &data) != 1) {
-                    // Didn't find hex data
-                    break;
-                }
-                hexdata[i] = byteswap(data);
-                offs += 4;
+            hexaddr = (rec.addr >> 1) + (hexseg << 3);
+            hexlen = rec.len >> 1;
+            for (i = 0; i < hexlen; i++) {
+                hexdata[i] = rec.data[2 * i] | rec.data[2 * i + 1] << 8;
             }
-            if (i != len) break;
+            if (streaming) return streamRecord();
             return OTGW_ERROR_NONE;
-        } else if (tag == 1) {
+        } else if (rec.tag == 1) {
             // End-of-file record
             hexlen = 0;
+            hexeof = true;
             return OTGW_ERROR_NONE;
-        } else if (tag == 2) {
+        } else if (rec.tag == 2) {
             // Extended segment address record
-            if (sscanf(hexbuf + offs, hexwordfmt, &data) != 1) break;
-            hexseg = data;
-        } else if (tag == 4) {
+            if (rec.len < 2) break;
+            hexseg = rec.data[0] << 8 | rec.data[1];
+        } else if (rec.tag == 4) {
             // Extended linear address record
-            if (sscanf(hexbuf + offs, hexwordfmt, &data) != 1) break;
-            hexseg = data << 12;
+            if (rec.len < 2) break;
+            hexseg = (rec.data[0] << 8 | rec.data[1]) << 12;
         }
     }
+    if (n < 0) {
+        // Wait for more data to arrive
+        starved = true;
+        hexlen = 0;
+        lastaction = millis();
+        return OTGW_ERROR_NONE;
+    }
+    if (source->failed()) return OTGW_ERROR_HEX_ACCESS;
     return OTGW_ERROR_HEX_FORMAT;
 }
 
+// A hex file that is processed on the fly doesn't get checked beforehand
+OTGWError OTGWUpgrade::streamRecord() {
+    if (hexaddr < hexnext) return OTGW_ERROR_HEX_FORMAT;
+    hexnext = hexaddr + hexlen;
+    // The first record determines the PIC model
+    if (model == PICUNKNOWN) return OTGW_ERROR_NONE;
+    if (hexaddr >= info.eebase && hexaddr < info.eebase + info.datasize) {
+        // Collect the data memory contents
+        int eeaddr = hexaddr - info.eebase;
+        for (int i = 0; i < hexlen && eeaddr < info.datasize; i++, eeaddr++) {
+            datamem[eeaddr] = hexdata[i];
+            bitSet(eeused[eeaddr / 8], eeaddr % 8);
+        }
+    }
+    return OTGW_ERROR_NONE;
+}
+
+// Determine the target PIC from the first code words
+bool OTGWUpgrade::detectModel() {
+    int i, data;
+    for (i = 0; i < PICCOUNT; i++) {
+        data = hexdata[0] & pgm_read_word(&PicInfo[i].magic[0]);
+        if (data != pgm_read_word(&PicInfo[i].magic[1])) continue;
+        data = hexdata[1] & pgm_read_word(&PicInfo[i].magic[2]);
+        if (data != pgm_read_word(&PicInfo[i].magic[3])) continue;
+        model = i;
+        memcpy_P(&info, PicInfo + i, sizeof(struct PicInfo));
+        return true;
+    }
+    return false;
+}
+
+// Look for the new firmware type and, for the gateway firmware, version
+bool OTGWUpgrade::findVersion() {
+    unsigned short ptr = 0;
+    version = nullptr;
+    newfirmware = FIRMWARE_UNKNOWN;
+    while (ptr < info.datasize) {
+        char *s = (char *)datamem + ptr;
+        for (int fw = 0; fw < FIRMWARE_COUNT; fw++) {
+            const char *banner = (const char *)pgm_read_ptr(banners + fw);
+            char *p = strstr_P(s, banner);
+            if (p == nullptr) continue;
+            newfirmware = (OTGWFirmware)fw;
+            if (fw != FIRMWARE_OTGW) return false;
+            version = p + strlen_P(banner);
+            Dprintf("Version: %s\n", version);
+            return true;
+        }
+        ptr += strnlen(s, info.datasize - ptr) + 1;
+    }
+    return false;
+}
+
+// Check for an earlier attempt to install the same image that didn't finish
+void OTGWUpgrade::loadCheckpoint() {
+    char buffer[48], ver[16];
+    unsigned long hash;
+    unsigned int addr;
+
+    resume = 0;
+    File f = LittleFS.open(CHECKPOINT, "r");
+    if (!f) return;
+    int len = f.readBytesUntil('\n', buffer, sizeof(buffer) - 1);
+    buffer[len] = '\0';
+    f.close();
+    if (sscanf(buffer, "%lx %x %15s", &hash, &addr, ver) != 3) return;
+    if (hash != imagehash) return;
+    Dprintf("Resume upgrade at 0x%04x\n", addr);
+    resume = addr;
+    // The PIC can't report its firmware version in the middle of an upgrade
+    if (strcmp(ver, "-") != 0) strcpy(oldversion, ver);
+}
+
+// Record that all program memory below addr has been verified
+void OTGWUpgrade::saveCheckpoint(unsigned short addr, const char *ver) {
+    // The image of a stream is only known at the end
+    if (streaming) return;
+    File f = LittleFS.open(CHECKPOINT, "w");
+    if (f) {
+        f.printf("%08lx %04x %s\n", imagehash, addr, *ver ? ver : "-");
+        f.close();
+    }
+}
+
+// Start the upgrade as soon as the first data record is available
+void OTGWUpgrade::streamStart() {
+    OTGWError rc = readHexRecord();
+    if (starved) return;
+    if (rc == OTGW_ERROR_NONE) {
+        if (hexlen < 2 || hexaddr != 0) {
+            rc = OTGW_ERROR_HEX_FORMAT;
+        } else if (!detectModel()) {
+            rc = OTGW_ERROR_MAGIC;
+        }
+    }
+    if (rc != OTGW_ERROR_NONE) {
+        finishUpgrade(rc);
+        return;
+    }
+    Dprintf("model: %d\n", model);
+
+    // The amount of code is unknown, so assume all rows will be programmed
+    total = WEIGHT_RESET + WEIGHT_VERSION
+      + (info.codesize / info.erasesize - 8) * WEIGHT_CODEPROG
+      + info.datasize / 64 * WEIGHT_DATAPROG;
+    if (firmware == FIRMWARE_OTGW && *fwversion) {
+        total += 4 * WEIGHT_DATAREAD;
+    }
+    stateMachine();
+}
+
 OTGWError OTGWUpgrade::readHexFile(const char *hexfile) {
     int linecnt = 0, addr = 0, weight, rowsize = 0;
     byte datamap = 0;
     OTGWError rc = OTGW_ERROR_NONE;
+    char imgfile[64];
+    int len = strlen(hexfile);
+
+    if (!hexfd.open(hexfile)) {
+        return finishUpgrade(OTGW_ERROR_HEX_ACCESS);
+    }
 
-    hexfd = LittleFS.open(hexfile, "r");
-    if (!hexfd) return finishUpgrade(OTGW_ERROR_HEX_ACCESS);
-    hexfd.setTimeout(0);
+    // Name of the preparsed image: replace the .hex extension
+    if (len > 4 && strcmp_P(hexfile + len - 4, PSTR(".hex")) == 0) len -= 4;
+    snprintf_P(imgfile, sizeof(imgfile), PSTR("%.*s%s"), len, hexfile, IMAGE_SUFFIX);
+    if (loadImage(imgfile)) {
+        hexfd.close();
+        return OTGW_ERROR_NONE;
+    }
 
     model = PICUNKNOWN;
     memset(datamem, -1, 256 * sizeof(char));
@@ -225,31 +632,28 @@ OTGWError OTGWUpgrade::readHexFile(const char *hexfile) {
     hexseg = 0;
     hexaddr = 0;
     hexpos = 0;
+    hexeof = false;
+    // FNV-1a hash of the image, to recognize it in a checkpoint
+    imagehash = 2166136261;
     while (rc == OTGW_ERROR_NONE) {
         rc = readHexRecord();
         if (hexlen == 0) break;
         linecnt++;
         if (rc != OTGW_ERROR_NONE) break;
+        imagehash = (imagehash ^ hexaddr) * 16777619;
+        for (int i = 0; i < hexlen; i++) {
+            imagehash = (imagehash ^ hexdata[i]) * 16777619;
+        }
         if (hexaddr < addr) {
             rc = OTGW_ERROR_HEX_FORMAT;
             break;
         }
         if (hexaddr == 0) {
             // Determine the target PIC
-            int i, data;
-            for (i = 0; i < PICCOUNT; i++) {
-                data = hexdata[0] & pgm_read_word(&PicInfo[i].magic[0]);
-                if (data != pgm_read_word(&PicInfo[i].magic[1])) continue;
-                data = hexdata[1] & pgm_read_word(&PicInfo[i].magic[2]);
-                if (data != pgm_read_word(&PicInfo[i].magic[3])) continue;
-                break;
-            }
-            if (i == PICCOUNT) {
+            if (!detectModel()) {
                 rc = OTGW_ERROR_MAGIC;
                 break;
             }
-            model = i;
-            memcpy_P(&info, PicInfo + i, sizeof(struct PicInfo));
             rowsize = info.erasesize;
         }
         if (hexaddr < info.codesize) {
@@ -293,39 +697,285 @@ OTGWError OTGWUpgrade::readHexFile(const char *hexfile) {
     // The self-programming code will be skipped (assume 256 program words)
     weight -= 8 * WEIGHT_CODEPROG;
 
-    // Look for the new firmware version
-    version = nullptr;
-    unsigned short ptr = 0;
-    while (ptr < info.datasize) {
-        char *s = strstr_P((char *)datamem + ptr, banner1);
-        if (s == nullptr) {
-            ptr += strnlen((char *)datamem + ptr,
-              info.datasize - ptr) + 1;
+    // Save the parsing effort for the next time
+    saveImage(imgfile, weight);
+    if (loadImage(imgfile)) {
+        hexfd.close();
+        return OTGW_ERROR_NONE;
+    }
+
+    loadCheckpoint();
+
+    if (findVersion() && ((*fwversion && firmware == FIRMWARE_OTGW) || *oldversion)
+      && mode == MODE_UPGRADE) {
+        // Reading out the EEPROM settings takes 4 reads of 64 bytes
+        weight += 4 * WEIGHT_DATAREAD;
+    }
+
+    total = weight;
+    return OTGW_ERROR_NONE;
+}
+
+// Use the preparsed image of the hex file, if it is still up to date. A
+// standalone image, like a backup, doesn't have a hex file.
+bool OTGWUpgrade::loadImage(const char *imgfile, bool standalone) {
+    struct ImageHeader hdr;
+    int weight;
+
+    imaged = false;
+    imgfd = LittleFS.open(imgfile, "r");
+    if (!imgfd) return false;
+    if (imgfd.read((uint8_t *)&hdr, sizeof(hdr)) != sizeof(hdr)
+      || hdr.magic != IMAGE_MAGIC || hdr.model >= PICCOUNT
+      || (standalone ? hdr.hexsize != 0 : hdr.hexsize != hexfd.size()
+      || hdr.hexdate != (uint32_t)hexfd.lastWrite())
+      || imgfd.size() != sizeof(hdr) + 288 + hdr.rows * 66
+      || imgfd.read(datamem, 256) != 256 || imgfd.read(eeused, 32) != 32) {
+        imgfd.close();
+        return false;
+    }
+
+    model = hdr.model;
+    memcpy_P(&info, PicInfo + model, sizeof(struct PicInfo));
+    imagehash = hdr.imagehash;
+    for (int i = 0; i < 256; i++) {
+        // Indicate the addresses that probably need to be written
+        eedata[i] = bitRead(eeused[i / 8], i % 8) ? ~datamem[i] : datamem[i];
+    }
+    imaged = true;
+    Dprintf("model: %d (image)\n", model);
+
+    weight = hdr.weight;
+    loadCheckpoint();
+    if (findVersion() && ((*fwversion && firmware == FIRMWARE_OTGW) || *oldversion)
+      && mode == MODE_UPGRADE && !standalone) {
+        // Reading out the EEPROM settings takes 4 reads of 64 bytes
+        weight += 4 * WEIGHT_DATAREAD;
+    }
+    total = weight;
+    return true;
+}
+
+// Store the program memory rows and data memory contents of the hex file
+// that has just been checked in a form that needs no further parsing
+void OTGWUpgrade::saveImage(const char *imgfile, unsigned short weight) {
+    struct ImageHeader hdr = {};
+    byte used[32] = {};
+    int addr;
+    bool ok;
+
+    File f = LittleFS.open(imgfile, "w");
+    if (!f) return;
+    for (int i = 0; i < 256; i++) {
+        if (datamem[i] != eedata[i]) bitSet(used[i / 8], i % 8);
+    }
+    // The magic number is filled in when the image is complete
+    ok = f.write((uint8_t *)&hdr, sizeof(hdr)) == sizeof(hdr)
+      && f.write(datamem, 256) == 256 && f.write(used, 32) == 32;
+
+    restart();
+    while (ok && (addr = prepareCode(codemem)) >= 0 && addr < info.codesize) {
+        uint16_t rowaddr = addr;
+        ok = f.write((uint8_t *)&rowaddr, sizeof(rowaddr)) == sizeof(rowaddr)
+          && f.write((uint8_t *)codemem, 64) == 64;
+        hdr.rows++;
+        if (hexeof) break;
+    }
+    // Without a complete image, the hex file has to be parsed each time
+    if (!ok) addr = -1;
+    if (addr >= 0) {
+        hdr.magic = IMAGE_MAGIC;
+        hdr.hexsize = hexfd.size();
+        hdr.hexdate = hexfd.lastWrite();
+        hdr.imagehash = imagehash;
+        hdr.weight = weight;
+        hdr.model = model;
+        if (!f.seek(0, SeekSet) || f.write((uint8_t *)&hdr, sizeof(hdr)) != sizeof(hdr)) {
+            addr = -1;
+        }
+    }
+    f.close();
+    if (addr < 0) LittleFS.remove(imgfile);
+}
+
+// Go back to the first row of program memory
+void OTGWUpgrade::restart() {
+    if (imaged) {
+        imgfd.seek(sizeof(struct ImageHeader) + 288, SeekSet);
+    } else {
+        source->rewind();
+        hexseg = 0;
+        hexaddr = 0;
+        hexpos = 0;
+        hexlen = 0;
+        hexeof = false;
+        rowbusy = false;
+    }
+}
+
+// Get the next row of program memory from the preparsed image
+int OTGWUpgrade::imageRow(unsigned short *buffer) {
+    uint16_t addr;
+    // The end of the program memory
+    if (!imgfd.available()) return info.codesize;
+    if (imgfd.read((uint8_t *)&addr, sizeof(addr)) != sizeof(addr)
+      || imgfd.read((uint8_t *)buffer, 64) != 64) {
+        hexresult = OTGW_ERROR_HEX_ACCESS;
+        return -1;
+    }
+    return addr;
+}
+
+OTGWHexCheck::OTGWHexCheck()
+  : linelen(0), eof(false), result(OTGW_ERROR_NONE), addr(0), seg(0),
+    model(PICUNKNOWN), fwtype(FIRMWARE_UNKNOWN) {
+    memset(datamem, -1, sizeof(datamem) - 1);
+    // Terminate the last string
+    datamem[sizeof(datamem) - 1] = '\0';
+    fwver[0] = '\0';
+}
+
+// Process one line of the hex file
+OTGWError OTGWHexCheck::record() {
+    OTGWHexRecord rec;
+    OTGWError rc;
+    int len, data, hexaddr, i;
+
+    // Ignore blank lines and anything after the end-of-file record
+    if (linelen == 0 || eof) return OTGW_ERROR_NONE;
+    line[linelen] = '\0';
+    rc = hexDecode(line, &rec);
+    if (rc != OTGW_ERROR_NONE) return rc;
+    if (rec.len & 1) return OTGW_ERROR_HEX_DATASIZE;
+
+    switch (rec.tag) {
+     case 0:
+        // Data record
+        hexaddr = (rec.addr >> 1) + (seg << 3);
+        len = rec.len >> 1;
+        if (hexaddr < addr) return OTGW_ERROR_HEX_FORMAT;
+        if (hexaddr == 0) {
+            // Determine the target PIC
+            unsigned short word[2];
+            if (len < 2) return OTGW_ERROR_MAGIC;
+            for (i = 0; i < 2; i++) {
+                word[i] = rec.data[2 * i] | rec.data[2 * i + 1] << 8;
+            }
+            for (i = 0; i < PICCOUNT; i++) {
+                data = word[0] & pgm_read_word(&PicInfo[i].magic[0]);
+                if (data != pgm_read_word(&PicInfo[i].magic[1])) continue;
+                data = word[1] & pgm_read_word(&PicInfo[i].magic[2]);
+                if (data != pgm_read_word(&PicInfo[i].magic[3])) continue;
+                break;
+            }
+            if (i == PICCOUNT) return OTGW_ERROR_MAGIC;
+            model = (OTGWProcessor)i;
+            memcpy_P(&info, PicInfo + i, sizeof(struct PicInfo));
+        }
+        // The PIC model must be known at this point
+        if (model == PICUNKNOWN) return OTGW_ERROR_HEX_FORMAT;
+        if (hexaddr >= info.eebase && hexaddr < info.eebase + info.datasize) {
+            // Data memory (only the low byte of each word is used)
+            int eeaddr = hexaddr - info.eebase;
+            for (i = 0; i < len && eeaddr < info.datasize; i++, eeaddr++) {
+                datamem[eeaddr] = rec.data[2 * i];
+            }
+        }
+        addr = hexaddr + len;
+        break;
+     case 1:
+        // End-of-file record
+        eof = true;
+        break;
+     case 2:
+        // Extended segment address record
+        if (rec.len < 2) return OTGW_ERROR_HEX_FORMAT;
+        seg = rec.data[0] << 8 | rec.data[1];
+        break;
+     case 4:
+        // Extended linear address record
+        if (rec.len < 2) return OTGW_ERROR_HEX_FORMAT;
+        seg = (rec.data[0] << 8 | rec.data[1]) << 12;
+        break;
+    }
+    return OTGW_ERROR_NONE;
+}
+
+OTGWError OTGWHexCheck::feed(const uint8_t *data, size_t len) {
+    while (result == OTGW_ERROR_NONE && len-- > 0) {
+        char ch = *data++;
+        if (ch == '\n') {
+            result = record();
+            linelen = 0;
+        } else if (ch == '\r') {
+            // Ignore
+        } else if (linelen < sizeof(line) - 1) {
+            line[linelen++] = ch;
         } else {
-            s += sizeof(banner1) - 1;   // Drop the terminating '\0'
-            version = s;
-            Dprintf("Version: %s\n", version);
-            if (firmware == FIRMWARE_OTGW && *fwversion) {
-                // Reading out the EEPROM settings takes 4 reads of 64 bytes
-                weight += 4 * WEIGHT_DATAREAD;
+            // Line too long
+            result = OTGW_ERROR_HEX_FORMAT;
+        }
+    }
+    return result;
+}
+
+OTGWError OTGWHexCheck::finish() {
+    // The last line may not have a line ending
+    if (result == OTGW_ERROR_NONE) result = record();
+    linelen = 0;
+    if (result != OTGW_ERROR_NONE) return result;
+    // The file must have been complete
+    if (!eof) return result = OTGW_ERROR_HEX_FORMAT;
+    if (model == PICUNKNOWN) return result = OTGW_ERROR_MAGIC;
+
+    // Look for the firmware banner
+    for (int fw = 0; fw < FIRMWARE_COUNT; fw++) {
+        const char *banner = (const char *)pgm_read_ptr(banners + fw);
+        unsigned short ptr = 0;
+        while (ptr < info.datasize) {
+            char *s = (char *)datamem + ptr;
+            int len = strnlen(s, info.datasize - ptr);
+            s = strstr_P(s, banner);
+            if (s != nullptr) {
+                s += strlen_P(banner);
+                len = strlen(s);
+                if (len >= (int)sizeof(fwver)) len = sizeof(fwver) - 1;
+                memcpy(fwver, s, len);
+                fwver[len] = '\0';
+                fwtype = (OTGWFirmware)fw;
+                return result;
             }
-            break;
+            ptr += len + 1;
         }
     }
+    return result;
+}
 
-    total = weight;
-    return OTGW_ERROR_NONE;
+static int versionNumber(const char **s) {
+    int n = 0;
+    while (isdigit(**s)) n = 10 * n + *(*s)++ - '0';
+    return n;
+}
+
+// Versions with the same major and minor number
+static bool samerelease(const char *version1, const char *version2) {
+    int major1, minor1, major2, minor2;
+
+    if (sscanf(version1, "%d.%d", &major1, &minor1) != 2
+      || sscanf(version2, "%d.%d", &major2, &minor2) != 2) {
+        return false;
+    }
+    return major1 == major2 && minor1 == minor2;
 }
 
-int OTGWUpgrade::versionCompare(const char *version1, const char* version2) {
+int versionCompare(const char *version1, const char* version2) {
     const char *s1 = version1, *s2 = version2;
-    int v1, v2, n;
+    int v1, v2;
 
     while (*s1 && *s2) {
-        if (!sscanf(s1, "%d%n", &v1, &n)) return 0;
-        s1 += n;
-        if (!sscanf(s2, "%d%n", &v2, &n)) return 0;
-        s2 += n;
+        if (!isdigit(*s1) || !isdigit(*s2)) return 0;
+        v1 = versionNumber(&s1);
+        v2 = versionNumber(&s2);
         if (v1 < v2) return -1;
         if (v1 > v2) return 1;
         if (*s1 != *s2) {
@@ -339,37 +989,40 @@ int OTGWUpgrade::versionCompare(const char *version1, const char* version2) {
             if (*s1 == 0) return -1;
             if (*s2 == 0) return 1;
         }
+        // Both versions are the same
+        if (*s1 == 0) break;
         s1++;
         s2++;
     }
     return 0;
 }
 
-int OTGWUpgrade::eepromSettings(const char *version, OTGWTransferData *xfer) {
-    char buffer[64];
-    int last = 0, len, id, p1, p2, addr, size, mask, n;
-    File f;
-
-    f = LittleFS.open("/transfer.dat", "r");
-    if (!f) return last;
-    while (f.available()) {
-        len = f.readBytesUntil('\n', buffer, sizeof(buffer) - 1);
-        buffer[len] = '\0';
-        if ((n = sscanf(buffer, "%d %n%*s%n %x %d %x", &id, &p1, &p2, &addr, &size, &mask)) == 4) {
-            if (id >= XFER_MAX_ID) break;
-            buffer[p2] = '\0';
-            if (versionCompare(version, buffer + p1) < 0) continue;
-            xfer[id].addr = addr;
-            xfer[id].size = size;
-            xfer[id].mask = mask;
-            if (id > last) last = id;
+// Fill in the locations of the settings for a firmware version. Returns
+// the highest id of the settings that were found.
+int eepromSettings(const char *version, OTGWTransferData *xfer) {
+    char buffer[XFER_VERSION_LEN];
+    struct TransferEntry entry;
+    int last = 0, current = -1;
+
+    for (unsigned int i = 0; i < sizeof(xfertable) / sizeof(*xfertable); i++) {
+        memcpy_P(&entry, xfertable + i, sizeof(entry));
+        if (entry.version != current) {
+            memcpy_P(buffer, xferversions[entry.version], sizeof(buffer));
+            // The table is sorted, so none of the remaining entries apply
+            if (versionCompare(version, buffer) < 0) break;
+            current = entry.version;
         }
+        xfer[entry.id].addr = entry.addr;
+        xfer[entry.id].size = entry.size;
+        xfer[entry.id].mask = entry.mask;
+        if (entry.id > last) last = entry.id;
     }
-    f.close();
     return last;
 }
 
-void OTGWUpgrade::transferSettings(const char *ver1, const char *ver2) {
+// Insert the settings from data memory contents olddata, which belong to
+// firmware version ver1, into the data memory for version ver2
+void OTGWUpgrade::transferSettings(const char *ver1, const char *ver2, const byte *olddata) {
     OTGWTransferData xfer1[XFER_MAX_ID] = {}, xfer2[XFER_MAX_ID] = {};
     int last, i, j, mask;
     byte value;
@@ -379,7 +1032,7 @@ void OTGWUpgrade::transferSettings(const char *ver1, const char *ver2) {
         if (xfer1[i].size) {
             for (j = 0; j < xfer1[i].size; j++) {
                 if (xfer1[i].addr < info.datasize) {
-                    value = eedata[xfer1[i].addr + j];
+                    value = olddata[xfer1[i].addr + j];
                 } else {
                     value = xfer1[i].addr & 0xff;
                 }
@@ -387,39 +1040,338 @@ void OTGWUpgrade::transferSettings(const char *ver1, const char *ver2) {
                     // Combine the masks
                     mask = xfer1[i].mask | xfer2[i].mask;
                     // Insert the old data into the data array
-                    datamem[xfer2[i].addr + j] = datamem[xfer2[i].addr + j] & mask | value & ~mask;
+                    datamem[xfer2[i].addr + j] = (datamem[xfer2[i].addr + j] & mask) | (value & ~mask);
                 }
             }
         }
     }
 }
 
+// Collect the code words for the next row of program memory. Returns the
+// start address of the row, or -1 if the row could not be completed yet.
 int OTGWUpgrade::prepareCode(unsigned short *buffer) {
-    unsigned int addr, start, n;
+    unsigned int addr;
     const unsigned int rowsize = info.erasesize;
     const unsigned int mask = rowsize - 1;
 
-    memset(buffer, -1, rowsize * sizeof(short));
-
-    addr = hexaddr + hexpos;
-    start = addr & ~mask;
-    n = addr - start;
+    if (!rowbusy) {
+        memset(buffer, -1, rowsize * sizeof(short));
+        addr = hexaddr + hexpos;
+        rowstart = addr & ~mask;
+        rowfill = addr - rowstart;
+        rowbusy = true;
+    }
 
     while (true) {
         if (hexpos >= hexlen) {
-            readHexRecord();
+            hexresult = readHexRecord();
+            // Continue where we left off when more data has arrived
+            if (starved) return -1;
+            if (hexresult != OTGW_ERROR_NONE) {
+                rowbusy = false;
+                return -1;
+            }
             if (hexlen == 0) break;
             addr = hexaddr;
             hexpos = 0;
-            if (n == 0) {
-                start = addr & ~mask;
+            if (rowfill == 0) {
+                rowstart = addr & ~mask;
+            }
+            rowfill = addr - rowstart;
+        }
+        if (rowfill >= rowsize) break;
+        buffer[rowfill++] = hexdata[hexpos++];
+    }
+    rowbusy = false;
+    return rowstart;
+}
+
+// Start programming the next row of program memory that is not protected,
+// or continue with the data memory when all code has been programmed
+void OTGWUpgrade::nextRow() {
+    int addr;
+    do {
+        addr = imaged ? imageRow(codemem) : prepareCode(codemem);
+        if (addr < 0) {
+            if (!starved) finishUpgrade(hexresult);
+            return;
+        }
+        pc = addr;
+    } while (pc + 31 >= protectstart && pc <= protectend);
+    if (pc >= info.codesize) {
+        // The old settings will have been overwritten after this point
+        saveCheckpoint(info.codesize, "");
+        dataStage();
+        return;
+    }
+    if (pc > resume && (pc / 32) % CHECKPOINT_ROWS == 0) {
+        saveCheckpoint(pc, oldversion);
+    }
+    if (pc < resume) {
+        // Rows programmed by an earlier, interrupted attempt
+        probing = true;
+        readCode(pc);
+    } else if (differential && misses < 2) {
+        // Check if the row already contains the new code. Once two rows in
+        // a row needed programming, the code has shifted, and the rest of
+        // the rows are programmed without checking.
+        probing = true;
+        readCode(pc);
+    } else {
+        eraseCode(pc);
+    }
+}
+
+void OTGWUpgrade::dataStage() {
+    stage = FWSTATE_DATA;
+    if (streaming) {
+        // Collect the remaining data memory records
+        while (!hexeof) {
+            OTGWError rc = readHexRecord();
+            if (starved) return;
+            if (rc != OTGW_ERROR_NONE) {
+                finishUpgrade(rc);
+                return;
+            }
+        }
+        findVersion();
+        for (int i = 0; i < info.datasize; i++) {
+            if (bitRead(eeused[i / 8], i % 8)) {
+                // Indicate the address probably needs to be written
+                if (!dumped) eedata[i] = ~datamem[i];
+            } else if (dumped) {
+                // The new firmware doesn't use this EEPROM address
+                datamem[i] = eedata[i];
+            }
+        }
+        // Transfer the EEPROM settings
+        if (dumped && version) transferSettings(oldversion, version, eedata);
+    }
+    pc = 0;
+    nextBlock();
+}
+
+// Check if a block of data memory needs to be written
+bool OTGWUpgrade::dataChanged(short addr) {
+    for (short i = 0; i < 64; i++) {
+        if (datamem[addr + i] != eedata[addr + i]) return true;
+    }
+    return false;
+}
+
+// Start writing the next block of data memory that needs to be changed,
+// or finish the upgrade if there is none
+void OTGWUpgrade::nextBlock() {
+    for (; pc < info.datasize; pc += 64) {
+        if (!dataChanged(pc)) continue;
+        if (differential && !dumped) {
+            // The current contents are unknown, read them first
+            probing = true;
+            readData(pc);
+        } else {
+            loadData(pc);
+        }
+        return;
+    }
+    finishUpgrade(OTGW_ERROR_NONE);
+}
+
+// Prepare for comparing the PIC memory with the firmware
+void OTGWUpgrade::verifyStage() {
+    OTGWTransferData xfer[XFER_MAX_ID] = {};
+    int last, i, j;
+
+    // Only compare the data memory addresses the firmware specifies
+    for (i = 0; i < info.datasize; i++) {
+        if (datamem[i] != eedata[i]) {
+            bitSet(eeused[i / 8], i % 8);
+        } else {
+            bitClear(eeused[i / 8], i % 8);
+        }
+    }
+    if (version) {
+        // Except those that hold the gateway settings
+        last = eepromSettings(version, xfer);
+        for (i = 0; i <= last; i++) {
+            for (j = 0; j < xfer[i].size; j++) {
+                if (xfer[i].addr + j < info.datasize) {
+                    bitClear(eeused[(xfer[i].addr + j) / 8], (xfer[i].addr + j) % 8);
+                }
+            }
+        }
+    }
+    stage = FWSTATE_VERIFY;
+    restart();
+    checkRow();
+}
+
+// Read the next row of program memory to compare against the firmware
+void OTGWUpgrade::checkRow() {
+    int addr;
+    do {
+        addr = imaged ? imageRow(codemem) : prepareCode(codemem);
+        if (addr < 0) {
+            finishUpgrade(hexresult);
+            return;
+        }
+        pc = addr;
+    } while (pc + 31 >= protectstart && pc <= protectend);
+    if (pc < info.codesize) {
+        readCode(pc);
+    } else {
+        pc = 0;
+        checkBlock();
+    }
+}
+
+// Read the next block of data memory that contains firmware data
+void OTGWUpgrade::checkBlock() {
+    for (; pc < info.datasize; pc += 64) {
+        for (short i = pc; i < pc + 64; i += 8) {
+            if (eeused[i / 8]) {
+                readData(pc);
+                return;
             }
-            n = addr - start;
         }
-        if (n >= rowsize) break;
-        buffer[n++] = hexdata[hexpos++];
     }
-    return start;
+    finishUpgrade(errcnt ? OTGW_ERROR_MISMATCHES : OTGW_ERROR_NONE);
+}
+
+// Returns the number of code words that differ from the firmware
+short OTGWUpgrade::compareCode(const unsigned short *data) {
+    short cnt = 0;
+    for (short i = 0; i < 32; i++) {
+        if (data[i] != (codemem[i] & 0x3fff)) {
+            serial->mismatch(false, pc + i, codemem[i] & 0x3fff, data[i]);
+            cnt++;
+        }
+    }
+    if (cnt) Dprintf("Verify Program 0x%04x: %d words differ\n", pc, cnt);
+    return cnt;
+}
+
+// Returns the number of data bytes that differ from the firmware
+short OTGWUpgrade::compareData(const byte *data) {
+    short cnt = 0;
+    for (short i = 0, addr = pc; i < 64; i++, addr++) {
+        if (bitRead(eeused[addr / 8], addr % 8) && data[i] != datamem[addr]) {
+            serial->mismatch(true, addr, datamem[addr], data[i]);
+            cnt++;
+        }
+    }
+    if (cnt) Dprintf("Verify EEDATA 0x%04x: %d bytes differ\n", pc, cnt);
+    return cnt;
+}
+
+// Start reading the PIC memory into the backup file
+void OTGWUpgrade::backupStage() {
+    byte header[sizeof(struct ImageHeader) + 288] = {};
+
+    // One read for each row of program memory outside the bootloader and
+    // each block of data memory
+    total = WEIGHT_RESET + WEIGHT_VERSION + WEIGHT_DATAREAD
+      * ((info.codesize - (protectend + 1 - protectstart)) / 32 + info.datasize / 64);
+    progress(0);
+    // Leave room for the header and data memory, which are written last
+    if (imgfd.write(header, sizeof(header)) != sizeof(header)) {
+        finishUpgrade(OTGW_ERROR_MEMORY);
+        return;
+    }
+    imagehash = 2166136261;
+    imgrows = 0;
+    stage = FWSTATE_BACKUP;
+    pc = 0;
+    backupRow();
+}
+
+// Read the next row of program memory, skipping the bootloader, or
+// continue with the data memory
+void OTGWUpgrade::backupRow() {
+    while (pc + 31 >= protectstart && pc <= protectend) pc += 32;
+    if (pc < info.codesize) {
+        readCode(pc);
+    } else {
+        pc = 0;
+        readData(pc);
+    }
+}
+
+// Complete the backup file. All data memory will be restored.
+void OTGWUpgrade::finishBackup() {
+    struct ImageHeader hdr = {};
+    hdr.magic = IMAGE_MAGIC;
+    hdr.imagehash = imagehash;
+    hdr.rows = imgrows;
+    hdr.weight = WEIGHT_RESET + WEIGHT_VERSION + imgrows * WEIGHT_CODEPROG
+      + info.datasize / 64 * WEIGHT_DATAPROG;
+    hdr.model = model;
+    memset(eeused, -1, sizeof(eeused));
+    if (!imgfd.seek(0, SeekSet)
+      || imgfd.write((uint8_t *)&hdr, sizeof(hdr)) != sizeof(hdr)
+      || imgfd.write(datamem, 256) != 256 || imgfd.write(eeused, 32) != 32) {
+        finishUpgrade(OTGW_ERROR_MEMORY);
+        return;
+    }
+    finishUpgrade(OTGW_ERROR_NONE);
+}
+
+// The current data memory contents have been read. Either save them, or
+// write back the changes needed to restore the settings of a profile.
+void OTGWUpgrade::settingsStage() {
+    struct SettingsHeader hdr = {};
+    byte saved[256];
+    File f;
+
+    // Find the version of the firmware on the PIC
+    memcpy(datamem, eedata, sizeof(datamem));
+    findVersion();
+    if (version) strncpy(hdr.version, version, sizeof(hdr.version) - 1);
+
+    if (mode == MODE_SAVESETTINGS) {
+        hdr.magic = SETTINGS_MAGIC;
+        hdr.model = model;
+        // Opening the file also creates the directory, renaming doesn't
+        char tmpfile[sizeof(filepath) + sizeof(SETTINGS_TMP)];
+        strcpy(tmpfile, filepath);
+        strcat(tmpfile, SETTINGS_TMP);
+        f = LittleFS.open(tmpfile, "w");
+        if (!f) {
+            finishUpgrade(OTGW_ERROR_HEX_ACCESS);
+            return;
+        }
+        bool ok = f.write((uint8_t *)&hdr, sizeof(hdr)) == sizeof(hdr)
+          && f.write(eedata, 256) == 256;
+        f.close();
+        // An existing profile is only replaced by a complete one
+        if (!ok) {
+            LittleFS.remove(tmpfile);
+            finishUpgrade(OTGW_ERROR_MEMORY);
+        } else if (!LittleFS.rename(tmpfile, filepath)) {
+            LittleFS.remove(tmpfile);
+            finishUpgrade(OTGW_ERROR_HEX_ACCESS);
+        } else {
+            finishUpgrade(OTGW_ERROR_NONE);
+        }
+        return;
+    }
+
+    f = LittleFS.open(filepath, "r");
+    if (!f || !f.seek(sizeof(hdr), SeekSet) || f.read(saved, 256) != 256) {
+        f.close();
+        finishUpgrade(OTGW_ERROR_HEX_ACCESS);
+        return;
+    }
+    f.close();
+    if (*oldversion && *hdr.version && strcmp(oldversion, hdr.version) != 0) {
+        // The profile was made with a different firmware version
+        transferSettings(oldversion, hdr.version, saved);
+    } else {
+        memcpy(datamem, saved, sizeof(datamem));
+    }
+    // Only blocks that differ from the current contents will be written
+    stage = FWSTATE_DATA;
+    pc = 0;
+    nextBlock();
 }
 
 void OTGWUpgrade::fwCommand(const unsigned char *cmd, int len) {
@@ -438,6 +1390,65 @@ void OTGWUpgrade::fwCommand(const unsigned char *cmd, int len) {
     }
     serial->putbyte(ETX);
     // Dprintf("\n");
+    commandSent(cmdcode <= CMD_WRITEDATA ? OTGW_CMD_VERSION + cmdcode : OTGW_CMD_RESET);
+}
+
+// Start the timer for the reply to a command
+void OTGWUpgrade::commandSent(byte type) {
+    pending = type;
+    sent = millis();
+    timeout = min(rttTimeout(type) << backoff, (unsigned long)TIMEOUT_MAX);
+}
+
+// Update the round trip time estimate, as in RFC 6298
+void OTGWUpgrade::rttSample(unsigned long ms) {
+    auto &r = rtt[pending];
+    int delta;
+
+    if (r.count == 0) {
+        r.srtt = ms << 3;
+        r.rttvar = ms << 1;
+    } else {
+        delta = ms - (r.srtt >> 3);
+        r.srtt += delta;
+        if (delta < 0) delta = -delta;
+        r.rttvar += delta - (r.rttvar >> 2);
+    }
+    r.count++;
+    if (ms > r.max) r.max = ms;
+    r.hist[min(ms / OTGW_RTT_BUCKET, (unsigned long)OTGW_RTT_BUCKETS - 1)]++;
+}
+
+unsigned long OTGWUpgrade::rttTimeout(byte type) {
+    const auto &r = rtt[type];
+    if (r.count == 0) return TIMEOUT_INITIAL;
+    unsigned long ms = (r.srtt >> 3) + max(r.rttvar, TIMEOUT_MARGIN);
+    return constrain(ms, (unsigned long)TIMEOUT_MIN, (unsigned long)TIMEOUT_MAX);
+}
+
+void OTGWUpgrade::rttStats(OTGWUpgradeStats *stats) {
+    stats->duration = millis() - started;
+    stats->timeouts = 0;
+    for (int i = 0; i < OTGW_CMD_COUNT; i++) {
+        const auto &r = rtt[i];
+        OTGWCommandStats *s = stats->cmd + i;
+        unsigned int n50 = (r.count + 1) / 2, n90 = (9 * r.count + 9) / 10;
+        unsigned int sum = 0;
+        s->count = r.count;
+        s->timeouts = r.timeouts;
+        s->max = r.max;
+        s->p50 = s->p90 = 0;
+        s->timeout = rttTimeout(i);
+        stats->timeouts += r.timeouts;
+        // Report the upper limit of the bucket the percentile falls in
+        for (int j = 0; j < OTGW_RTT_BUCKETS && sum < n90; j++) {
+            sum += r.hist[j];
+            unsigned short ms = min((j + 1) * OTGW_RTT_BUCKET, (int)r.max);
+            if (j == OTGW_RTT_BUCKETS - 1) ms = r.max;
+            if (s->p50 == 0 && sum >= n50) s->p50 = ms;
+            if (sum >= n90) s->p90 = ms;
+        }
+    }
 }
 
 void OTGWUpgrade::eraseCode(short addr) {
@@ -458,6 +1469,8 @@ short OTGWUpgrade::loadCode(short addr, const unsigned short *code, short len) {
         data[i] = code[i] & 0x3fff;
         if (data[i] != 0x3fff) size = i + 1;
     }
+    // Nothing to write in an erased row
+    if (size == 0) return 0;
     fwcommand[0] = CMD_WRITEPROG;
     if (info.blockwrite) {
         int block = info.groupsize;
@@ -488,6 +1501,8 @@ bool OTGWUpgrade::verifyCode(const unsigned short *code, const unsigned short *d
 
     for (i = 0; i < len; i++) {
         if (data[i] != (code[i] & 0x3fff)) {
+            // A row that was read before programming is expected to differ
+            if (probing) return false;
             Dprintf("Verify Program 0x%04x: 0x%04x <> 0x%04x\n",
               pc + i, data[i], code[i] & 0x3fff);
             errcnt++;
@@ -547,7 +1562,7 @@ void OTGWUpgrade::stateMachine(const unsigned char *packet, int len) {
     byte cmd = cmdcode;
 
     if (stage != FWSTATE_IDLE && packet == nullptr) {
-        int maxtries = (stage == FWSTATE_CODE || stage == FWSTATE_DATA ? 100 : 10);
+        int maxtries = (stage >= FWSTATE_CODE ? 100 : 10);
         if (++retries >= maxtries) {
             serial->resetPic();
             finishUpgrade(OTGW_ERROR_RETRIES);
@@ -555,7 +1570,15 @@ void OTGWUpgrade::stateMachine(const unsigned char *packet, int len) {
         }
         Dprintf("Retry (%d): stage = %d, pc = 0x%04x, cmd = %d\n",
           retries, stage, pc, cmdcode);
+        ambiguous = true;
     } else {
+        if (packet != nullptr) {
+            // Only a reply to a command that was sent once is a reliable
+            // measure of the round trip time
+            if (!ambiguous) rttSample(millis() - sent);
+            ambiguous = false;
+            backoff = 0;
+        }
         // Determine the (most likely) next command
         switch (cmdcode) {
          case CMD_READPROG:
@@ -581,7 +1604,9 @@ void OTGWUpgrade::stateMachine(const unsigned char *packet, int len) {
         errcnt = 0;
         retries = 0;
         done = 0;
+        started = millis();
         serial->resetPic();
+        commandSent(OTGW_CMD_RESET);
         stage = FWSTATE_RSET;
         break;
      case FWSTATE_RSET:
@@ -592,6 +1617,7 @@ void OTGWUpgrade::stateMachine(const unsigned char *packet, int len) {
             stage = FWSTATE_VERSION;
         } else {
             serial->resetPic();
+            commandSent(OTGW_CMD_RESET);
         }
         break;
      case FWSTATE_VERSION:
@@ -605,12 +1631,20 @@ void OTGWUpgrade::stateMachine(const unsigned char *packet, int len) {
                 finishUpgrade(OTGW_ERROR_DEVICE);
                 return;
             }
-            if (model == PICPROBE) {
+            if (mode == MODE_BACKUP || mode == MODE_SAVESETTINGS) {
+                // Take whatever PIC is present
+                model = pic;
+                memcpy_P(&info, PicInfo + model, sizeof(struct PicInfo));
+            } else if (model == PICPROBE) {
                 // Select the file depending on the detected PIC model
                 char hexfile[40];
-                snprintf_P(hexfile, sizeof(hexfile), "/%s/%s",
-                  serial->processorToString(pic).c_str(), filename);
-                OTGWError rc = readHexFile(hexfile);
+                OTGWError rc = OTGW_ERROR_HEX_ACCESS;
+                // A truncated path would name the wrong file
+                if (snprintf_P(hexfile, sizeof(hexfile), "/%s/%s",
+                  serial->processorToString(pic).c_str(), filename)
+                  < (int)sizeof(hexfile)) {
+                    rc = readHexFile(hexfile);
+                }
                 if (rc == OTGW_ERROR_NONE) {
                     // Correct the progress now the total has been determined
                     progress(0);
@@ -631,9 +1665,35 @@ void OTGWUpgrade::stateMachine(const unsigned char *packet, int len) {
             protectend = data[3];
             info.recover(protectstart, failsafe);
             progress(WEIGHT_VERSION);
-            if (firmware == FIRMWARE_OTGW && *fwversion && version) {
+            if (mode == MODE_VERIFY) {
+                verifyStage();
+                break;
+            }
+            if (mode == MODE_BACKUP) {
+                backupStage();
+                break;
+            }
+            if (mode != MODE_UPGRADE) {
+                // Only the data memory is needed for the settings
+                pc = 0;
+                readData(pc);
+                stage = FWSTATE_DUMP;
+                break;
+            }
+            // Rows that already hold the new code can be skipped when the
+            // PIC runs the same release of the same firmware. Between
+            // releases, too little code is the same to win back the reads.
+            // When streaming, the new version is not known yet.
+            differential = serial->_differential
+              && firmware != FIRMWARE_UNKNOWN && firmware == newfirmware
+              && (version == nullptr || samerelease(fwversion, version));
+            if (firmware == FIRMWARE_OTGW && *fwversion) {
+                strcpy(oldversion, fwversion);
+            }
+            if (*oldversion && (version || streaming)) {
                 // Both old and new gateway firmware versions are known
                 // Dump the current eeprom data to be able to transfer the settings
+                // When streaming, the new version only shows up at the end
                 pc = 0;
                 readData(pc);
                 stage = FWSTATE_DUMP;
@@ -653,7 +1713,9 @@ void OTGWUpgrade::stateMachine(const unsigned char *packet, int len) {
             const unsigned char *bytes = packet + 4;
             Dprintf("Dump EEPROM: 0x%04x\n", pc);
             for (int i = 0; i < 64; i++, pc++) {
-                if (datamem[pc] == eedata[pc]) {
+                if (streaming || mode != MODE_UPGRADE) {
+                    // The new data memory contents are not known yet
+                } else if (datamem[pc] == eedata[pc]) {
                     // The new firmware doesn't use this EEPROM address
                     // Keep the bytes the same to keep track of this
                     datamem[pc] = bytes[i];
@@ -663,9 +1725,13 @@ void OTGWUpgrade::stateMachine(const unsigned char *packet, int len) {
         }
         if (pc < info.datasize) {
             readData(pc);
+        } else if (mode != MODE_UPGRADE) {
+            dumped = true;
+            settingsStage();
         } else {
+            dumped = true;
             // Transfer the EEPROM settings
-            transferSettings(fwversion, version);
+            if (!streaming) transferSettings(oldversion, version, eedata);
             eraseCode(info.erasesize);
             stage = FWSTATE_PREP;
         }
@@ -687,14 +1753,10 @@ void OTGWUpgrade::stateMachine(const unsigned char *packet, int len) {
                 Dprintf("Fail safe code installed\n");
                 // The fail safe is in place, programming can start
                 progress(WEIGHT_CODEPROG);
-                // Return to the start of the file
-                hexfd.seek(0, SeekSet);
-                hexseg = 0;
-                hexaddr = 0;
-                hexpos = 0;
-                pc = prepareCode(codemem);
-                eraseCode(pc);
+                // Return to the first row. A stream still holds it.
+                if (!streaming) restart();
                 stage = FWSTATE_CODE;
+                nextRow();
             } else {
                 // Failed. Try again.
                 eraseCode(info.erasesize);
@@ -704,31 +1766,19 @@ void OTGWUpgrade::stateMachine(const unsigned char *packet, int len) {
      case FWSTATE_CODE:
         if (cmd == CMD_WRITEPROG) {
             // digitalWrite(LED2, LOW);
-            loadCode(pc, codemem);
+            // An erased row only needs to be checked
+            if (loadCode(pc, codemem) == 0) readCode(pc);
         } else if (cmd == CMD_READPROG) {
             // digitalWrite(LED2, HIGH);
             readCode(pc);
         } else if (cmd == CMD_ERASEPROG) {
-            if (packet != nullptr && packet[1] == 32 && data[1] == pc && verifyCode(codemem, data + 2)) {
-              do {
-                  pc = prepareCode(codemem);
-              } while (pc + 31 >= protectstart && pc <= protectend);
-                if (pc >= info.codesize) {
-                    pc = 0;
-                    stage = FWSTATE_DATA;
-                    while (loadData(pc) == 0) {
-                        pc += 64;
-                        if (pc >= info.datasize) {
-                            finishUpgrade(OTGW_ERROR_NONE);
-                            break;
-                        }
-                    }
-                    break;
-                } else {
-                    eraseCode(pc);
-                    progress(WEIGHT_CODEPROG);
-                    break;
-                }
+            bool same = packet != nullptr && packet[1] == 32 && data[1] == pc
+              && verifyCode(codemem, data + 2);
+            if (probing && packet != nullptr) misses = same ? 0 : misses + 1;
+            probing = false;
+            if (same) {
+                progress(WEIGHT_CODEPROG);
+                nextRow();
             } else {
                 eraseCode(pc);
             }
@@ -739,16 +1789,26 @@ void OTGWUpgrade::stateMachine(const unsigned char *packet, int len) {
             // digitalWrite(LED2, HIGH);
             readData(pc);
         } else if (cmd == CMD_WRITEDATA) {
-            if (packet != nullptr && verifyData(pc, packet + 4)) {
-                progress(WEIGHT_DATAPROG);
-                do {
-                    pc += 64;
-                    if (pc >= info.datasize) {
-                        finishUpgrade(OTGW_ERROR_NONE);
-                        break;
+            if (packet != nullptr && probing) {
+                // Only write the bytes that actually differ
+                const unsigned char *bytes = packet + 4;
+                probing = false;
+                for (int i = 0; i < 64; i++) {
+                    // Leave addresses the new firmware doesn't use alone
+                    if (datamem[pc + i] == eedata[pc + i]) {
+                        datamem[pc + i] = bytes[i];
                     }
+                    eedata[pc + i] = bytes[i];
+                }
+                if (loadData(pc) == 0) {
+                    progress(WEIGHT_DATAPROG);
+                    pc += 64;
+                    nextBlock();
                 }
-                while (loadData(pc) == 0);
+            } else if (packet != nullptr && verifyData(pc, packet + 4)) {
+                progress(WEIGHT_DATAPROG);
+                pc += 64;
+                nextBlock();
             } else {
                 Dprintf("Data block failed: 0x%04x\n", pc);
                 // Data is incorrect, try again
@@ -757,6 +1817,63 @@ void OTGWUpgrade::stateMachine(const unsigned char *packet, int len) {
             }
         }
         break;
+     case FWSTATE_BACKUP:
+        if (cmdcode == CMD_READPROG) {
+            if (packet != nullptr && packet[1] == 32 && data[1] == pc) {
+                uint16_t addr = pc;
+                imagehash = (imagehash ^ pc) * 16777619;
+                for (int i = 0; i < 32; i++) {
+                    imagehash = (imagehash ^ data[2 + i]) * 16777619;
+                }
+                if (imgfd.write((uint8_t *)&addr, sizeof(addr)) != sizeof(addr)
+                  || imgfd.write((const uint8_t *)(data + 2), 64) != 64) {
+                    // The file system is full
+                    finishUpgrade(OTGW_ERROR_MEMORY);
+                    break;
+                }
+                imgrows++;
+                progress(WEIGHT_DATAREAD);
+                pc += 32;
+                backupRow();
+            } else {
+                readCode(pc);
+            }
+        } else if (cmdcode == CMD_READDATA) {
+            if (packet != nullptr && packet[1] == 64 && packet[2] == (pc & 0xff)) {
+                memcpy(datamem + pc, packet + 4, 64);
+                progress(WEIGHT_DATAREAD);
+                pc += 64;
+                if (pc < info.datasize) {
+                    readData(pc);
+                } else {
+                    finishBackup();
+                }
+            } else {
+                readData(pc);
+            }
+        }
+        break;
+     case FWSTATE_VERIFY:
+        if (cmdcode == CMD_READPROG) {
+            if (packet != nullptr && packet[1] == 32 && data[1] == pc) {
+                if (compareCode(data + 2)) errcnt++;
+                // The total was calculated for programming the firmware
+                progress(WEIGHT_CODEPROG);
+                checkRow();
+            } else {
+                readCode(pc);
+            }
+        } else if (cmdcode == CMD_READDATA) {
+            if (packet != nullptr && packet[1] == 64 && packet[2] == (pc & 0xff)) {
+                if (compareData(packet + 4)) errcnt++;
+                progress(WEIGHT_DATAPROG);
+                pc += 64;
+                checkBlock();
+            } else {
+                readData(pc);
+            }
+        }
+        break;
     }
 
     if (stage != FWSTATE_IDLE) {
@@ -770,9 +1887,30 @@ OTGWError OTGWUpgrade::finishUpgrade(OTGWError result) {
         fwCommand(fwcommand, sizeof(fwcommand));
         stage = FWSTATE_IDLE;
     }
-    if (hexfd) hexfd.close();
+    hexfd.close();
+    imgfd.close();
+    if (mode == MODE_BACKUP) {
+        // Only replace an existing backup by a complete one. The rename
+        // takes the place of the old backup, so that one is kept if
+        // anything goes wrong.
+        if (result == OTGW_ERROR_NONE) {
+            File f = LittleFS.open(BACKUP_TMP, "r");
+            size_t size = f ? f.size() : 0;
+            f.close();
+            if (size != sizeof(struct ImageHeader) + 288 + imgrows * 66) {
+                result = OTGW_ERROR_MEMORY;
+            } else if (!LittleFS.rename(BACKUP_TMP, filepath)) {
+                result = OTGW_ERROR_HEX_ACCESS;
+            }
+        }
+        if (result != OTGW_ERROR_NONE) LittleFS.remove(BACKUP_TMP);
+    } else if (result == OTGW_ERROR_NONE && !streaming && mode == MODE_UPGRADE) {
+        LittleFS.remove(CHECKPOINT);
+    }
 
-    serial->finishUpgrade(result, errcnt, retries);
+    OTGWUpgradeStats stats;
+    rttStats(&stats);
+    serial->finishUpgrade(result, errcnt, retries, &stats);
     return result;
 }
 
@@ -807,13 +1945,41 @@ void OTGWUpgrade::upgradeEvent(int ch) {
 }
 
 bool OTGWUpgrade::upgradeTick() {
+    if (starved) {
+        if (!source->ready()) {
+            // The PIC is waiting for more hex data
+            if (millis() - lastaction > 30000) {
+                finishUpgrade(OTGW_ERROR_HEX_ACCESS);
+                return false;
+            }
+            return true;
+        }
+        starved = false;
+        switch (stage) {
+         case FWSTATE_IDLE:
+            streamStart();
+            break;
+         case FWSTATE_CODE:
+            nextRow();
+            break;
+         case FWSTATE_DATA:
+            dataStage();
+            break;
+        }
+        // The upgrade object may have been destroyed
+        return true;
+    }
+
     if (stage == FWSTATE_IDLE) {
         return false;
     }
 
-    if (millis() - lastaction > 1000) {
+    if (millis() - lastaction > timeout) {
         // Too much time has passed since the last action
-        Dprintf("Timeout:");
+        Dprintf("Timeout (%lu ms):", timeout);
+        rtt[pending].timeouts++;
+        // Allow more time for the next attempt
+        if (backoff < BACKOFF_MAX) backoff++;
         if (bufpos) {
             for (int i = 0; i < bufpos; i++) {
                 Dprintf(" %02x", buffer[i]);
@@ -963,6 +2129,16 @@ void OTGWSerial::registerFirmwareCallback(OTGWFirmwareReport *func) {
     _firmwareFunc = func;
 }
 
+void OTGWSerial::registerMismatchCallback(OTGWMismatchReport *func) {
+    _mismatchFunc = func;
+}
+
+// Allow skipping memory that already holds the new data, when upgrading
+// to another version of the firmware the PIC is running
+void OTGWSerial::differentialUpgrade(bool enable) {
+    _differential = enable;
+}
+
 void OTGWSerial::SetLED(int state) {
     if (_led >= 0) {
         digitalWrite(_led, state ? LOW : HIGH);
@@ -977,6 +2153,11 @@ void OTGWSerial::progress(int pct) {
     if (_progressFunc) _progressFunc(pct);
 }
 
+void OTGWSerial::mismatch(bool eeprom, unsigned short addr,
+  unsigned short expected, unsigned short actual) {
+    if (_mismatchFunc) _mismatchFunc(eeprom, addr, expected, actual);
+}
+
 // Look for banners in the incoming data and extract the version number
 void OTGWSerial::matchBanner(char ch) {
     for (int i = 0; i < FIRMWARE_COUNT; i++) {
@@ -1004,7 +2185,8 @@ void OTGWSerial::matchBanner(char ch) {
     }
 }
 
-OTGWError OTGWSerial::startUpgrade(const char *hexfile) {
+// Create the object that runs a session with the PIC bootloader
+OTGWError OTGWSerial::newUpgrade() {
     if (_upgrade != nullptr) {
         return OTGW_ERROR_INPROG;
     }
@@ -1015,12 +2197,55 @@ OTGWError OTGWSerial::startUpgrade(const char *hexfile) {
         return OTGW_ERROR_MEMORY;
     }
 
+    return OTGW_ERROR_NONE;
+}
+
+OTGWError OTGWSerial::startUpgrade(const char *hexfile) {
+    OTGWError rc = newUpgrade();
+    if (rc != OTGW_ERROR_NONE) return rc;
     return _upgrade->start(hexfile);
 }
 
-OTGWError OTGWSerial::finishUpgrade(OTGWError result, short errors, short retries) {
+OTGWError OTGWSerial::startUpgrade(OTGWUpgradeSource *source) {
+    OTGWError rc = newUpgrade();
+    if (rc != OTGW_ERROR_NONE) return rc;
+    return _upgrade->start(source);
+}
+
+OTGWError OTGWSerial::startVerify(const char *hexfile) {
+    OTGWError rc = newUpgrade();
+    if (rc != OTGW_ERROR_NONE) return rc;
+    return _upgrade->verify(hexfile);
+}
+
+OTGWError OTGWSerial::startBackup(const char *imgfile) {
+    OTGWError rc = newUpgrade();
+    if (rc != OTGW_ERROR_NONE) return rc;
+    return _upgrade->backup(imgfile);
+}
+
+OTGWError OTGWSerial::startRestore(const char *imgfile) {
+    OTGWError rc = newUpgrade();
+    if (rc != OTGW_ERROR_NONE) return rc;
+    return _upgrade->restore(imgfile);
+}
+
+OTGWError OTGWSerial::saveSettings(const char *path) {
+    OTGWError rc = newUpgrade();
+    if (rc != OTGW_ERROR_NONE) return rc;
+    return _upgrade->saveSettings(path);
+}
+
+OTGWError OTGWSerial::loadSettings(const char *path) {
+    OTGWError rc = newUpgrade();
+    if (rc != OTGW_ERROR_NONE) return rc;
+    return _upgrade->loadSettings(path);
+}
+
+OTGWError OTGWSerial::finishUpgrade(OTGWError result, short errors, short retries,
+  const OTGWUpgradeStats *stats) {
     if (_finishedFunc) {
-        _finishedFunc(result, errors, retries);
+        _finishedFunc(result, errors, retries, stats);
     }
     // Destroy the upgrade object to free the used memory and be ready
     // for a next upgrade
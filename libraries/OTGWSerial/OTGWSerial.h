@@ -27,6 +27,7 @@
 #define OTGWSerial_h
 
 #include <HardwareSerial.h>
+#include <FS.h>
 
 typedef enum {
     PIC16F88,
@@ -77,30 +78,184 @@ typedef struct {
     byte size, mask;
 } OTGWTransferData;
 
-typedef void OTGWUpgradeFinished(OTGWError result, short errors, short retries);
+int versionCompare(const char *version1, const char* version2);
+int eepromSettings(const char *version, OTGWTransferData *xfer);
+
+// One line of an Intel-HEX file
+typedef struct {
+    byte len, tag;
+    unsigned short addr;
+    byte data[16];
+} OTGWHexRecord;
+
+OTGWError hexDecode(const char *line, OTGWHexRecord *rec);
+
+// Bootloader commands, grouped by how long the PIC takes to reply
+typedef enum {
+    OTGW_CMD_RESET,
+    OTGW_CMD_VERSION,
+    OTGW_CMD_READPROG,
+    OTGW_CMD_WRITEPROG,
+    OTGW_CMD_ERASEPROG,
+    OTGW_CMD_READDATA,
+    OTGW_CMD_WRITEDATA,
+    OTGW_CMD_COUNT
+} OTGWCommandType;
+
+// Round trip time histograms: OTGW_RTT_BUCKET ms per bucket, the last
+// bucket holds everything above that
+#define OTGW_RTT_BUCKET 20
+#define OTGW_RTT_BUCKETS 32
+
+// Round trip times of one type of bootloader command (ms)
+typedef struct {
+    unsigned short count;       // Replies that were measured
+    unsigned short timeouts;    // Replies that didn't arrive in time
+    unsigned short p50, p90, max;
+    unsigned short timeout;     // Timeout in use at the end
+} OTGWCommandStats;
+
+typedef struct {
+    unsigned long duration;     // ms
+    unsigned short timeouts;
+    OTGWCommandStats cmd[OTGW_CMD_COUNT];
+} OTGWUpgradeStats;
+
+typedef void OTGWUpgradeFinished(OTGWError result, short errors, short retries,
+  const OTGWUpgradeStats *stats);
 typedef void OTGWUpgradeProgress(int pct);
 typedef void OTGWFirmwareReport(OTGWFirmware fw, const char *version);
+// A location in program memory (eeprom = false) or data memory that
+// doesn't hold the value of the firmware file during a verify
+typedef void OTGWMismatchReport(bool eeprom, unsigned short addr,
+  unsigned short expected, unsigned short actual);
 typedef void OTGWDebugFunction(const char *fmt, ...);
 
 class OTGWSerial;
 
+// Source of the hex file data for a firmware upgrade
+class OTGWUpgradeSource {
+public:
+   virtual ~OTGWUpgradeSource() {}
+   // Get the next line of the hex file. Returns the line length, 0 at the
+   // end of the data, or -1 if the next line has not arrived yet.
+   virtual int readLine(char *buffer, int size) = 0;
+   // Is a complete line, or the end of the data, available?
+   virtual bool ready() {return true;}
+   // Start reading from the beginning again, if possible
+   virtual bool rewind() {return false;}
+   // The data transfer was aborted
+   virtual bool failed() {return false;}
+};
+
+class OTGWFileSource : public OTGWUpgradeSource {
+public:
+   ~OTGWFileSource() {close();}
+   bool open(const char *path);
+   void close();
+   int readLine(char *buffer, int size);
+   bool rewind();
+   size_t size() {return _file.size();}
+   time_t lastWrite() {return _file.getLastWrite();}
+protected:
+   File _file;
+};
+
+// Bounded queue of hex data that is filled while the upgrade is running.
+// The producer must not write more than room() bytes. The upgrade takes
+// data out of the queue at the pace of the bootloader.
+class OTGWStreamSource : public OTGWUpgradeSource {
+public:
+   OTGWStreamSource(size_t size = 1024);
+   ~OTGWStreamSource();
+   size_t room() {return _size - _fill;}
+   size_t write(const uint8_t *data, size_t len);
+   void end() {_ended = true;}
+   void abort() {_ended = _failed = true;}
+   int readLine(char *buffer, int size);
+   bool ready() {return _lines > 0 || _ended;}
+   bool failed() {return _failed;}
+protected:
+   uint8_t *_buffer;
+   size_t _size, _head, _fill, _lines;
+   bool _ended, _failed;
+};
+
+// Validate an Intel-HEX file while it is being received. The data can be
+// fed in chunks of any size. Records are checked for syntax, checksum,
+// and address order. The target PIC and firmware version are determined
+// from the contents.
+class OTGWHexCheck {
+public:
+   OTGWHexCheck();
+   OTGWError feed(const uint8_t *data, size_t len);
+   OTGWError finish();
+   OTGWProcessor processor() {return model;}
+   OTGWFirmware firmware() {return fwtype;}
+   const char *version() {return fwver;}
+protected:
+   OTGWError record();
+
+   char line[48];
+   byte linelen;
+   bool eof;
+   OTGWError result;
+   int addr;
+   short seg;
+   OTGWProcessor model;
+   struct PicInfo info;
+   unsigned char datamem[257];
+   OTGWFirmware fwtype;
+   char fwver[16];
+};
+
 class OTGWUpgrade {
 public:
    OTGWUpgrade(OTGWSerial *serial);
    ~OTGWUpgrade();
    OTGWError start(const char *hexfile);
+   OTGWError start(OTGWUpgradeSource *source);
+   OTGWError verify(const char *hexfile);
+   OTGWError backup(const char *imgfile);
+   OTGWError restore(const char *imgfile);
+   OTGWError saveSettings(const char *path);
+   OTGWError loadSettings(const char *path);
    void upgradeEvent(int ch);
    bool upgradeTick();
 protected:
    void progress(int weight);
-   unsigned char hexChecksum(char *hex, int len);
    OTGWError readHexRecord();
    OTGWError readHexFile(const char *hexfile);
-   int versionCompare(const char *version1, const char* version2);
-   int eepromSettings(const char *version, OTGWTransferData *xfer);
-   void transferSettings(const char *ver1, const char *ver2);
+   bool loadImage(const char *imgfile, bool standalone = false);
+   void saveImage(const char *imgfile, unsigned short weight);
+   int imageRow(unsigned short *buffer);
+   void restart();
+   OTGWError streamRecord();
+   void streamStart();
+   bool detectModel();
+   bool findVersion();
+   void loadCheckpoint();
+   void saveCheckpoint(unsigned short addr, const char *ver);
+   void transferSettings(const char *ver1, const char *ver2, const byte *olddata);
    int prepareCode(unsigned short *buffer);
+   void nextRow();
+   void dataStage();
+   void nextBlock();
+   bool dataChanged(short addr);
+   void verifyStage();
+   void checkRow();
+   void checkBlock();
+   short compareCode(const unsigned short *data);
+   short compareData(const byte *data);
+   void backupStage();
+   void backupRow();
+   void finishBackup();
+   void settingsStage();
    void fwCommand(const unsigned char *cmd, int len);
+   void commandSent(byte type);
+   void rttSample(unsigned long ms);
+   unsigned long rttTimeout(byte type);
+   void rttStats(OTGWUpgradeStats *stats);
    void eraseCode(short addr);
    short loadCode(short addr, const unsigned short *code, short len = 32);
    void readCode(short addr, short len = 32);
@@ -128,12 +283,50 @@ protected:
    unsigned long lastaction;
    struct PicInfo info;
    // Variables for reading a hex file line by line
-   File hexfd;
-   int hexaddr;
+   OTGWFileSource hexfd;
+   OTGWUpgradeSource *source;
+   int hexaddr, hexnext;
    short hexseg;
    byte hexlen, hexpos;
+   bool hexeof;
    unsigned short hexdata[8];
    char *version;
+   // Row of program memory being collected by prepareCode()
+   unsigned short rowstart, rowfill;
+   bool rowbusy;
+   // Streaming: the hex data is not available in advance
+   bool streaming, starved;
+   OTGWError hexresult;
+   // Data memory addresses used by the new firmware
+   byte eeused[32];
+   char oldversion[16];
+   // Only reprogram memory that differs from the new firmware
+   OTGWFirmware newfirmware;
+   bool differential, probing, dumped;
+   byte misses;
+   // Checkpoint of an interrupted upgrade
+   uint32_t imagehash;
+   unsigned short resume;
+   // Preparsed copy of the hex file
+   File imgfd;
+   bool imaged;
+   // What to do with the PIC memory
+   byte mode;
+   // File for a backup or settings profile
+   char filepath[32];
+   unsigned short imgrows;
+   // Round trip times of the bootloader commands. The estimator state
+   // is kept scaled: 8 * smoothed round trip time, 4 * variation.
+   struct {
+       int srtt, rttvar;
+       unsigned short count, timeouts, max;
+       unsigned short hist[OTGW_RTT_BUCKETS];
+   } rtt[OTGW_CMD_COUNT];
+   // Type and time of the command waiting for a reply
+   byte pending, backoff;
+   // A retried command may get the reply of the earlier attempt
+   bool ambiguous;
+   unsigned long sent, timeout, started;
 };
 
 class OTGWSerial: public HardwareSerial {
@@ -173,9 +366,17 @@ public:
    bool busy();
    void resetPic();
    OTGWError startUpgrade(const char *hexfile);
+   OTGWError startUpgrade(OTGWUpgradeSource *source);
+   OTGWError startVerify(const char *hexfile);
+   OTGWError startBackup(const char *imgfile);
+   OTGWError startRestore(const char *imgfile);
+   OTGWError saveSettings(const char *path);
+   OTGWError loadSettings(const char *path);
    void registerFinishedCallback(OTGWUpgradeFinished *func);
    void registerProgressCallback(OTGWUpgradeProgress *func);
    void registerFirmwareCallback(OTGWFirmwareReport *func);
+   void registerMismatchCallback(OTGWMismatchReport *func);
+   void differentialUpgrade(bool enable);
 #ifdef DEBUG
    void registerDebugFunc(OTGWDebugFunction *func);
 #endif
@@ -185,13 +386,19 @@ protected:
    OTGWUpgradeFinished *_finishedFunc = nullptr;
    OTGWUpgradeProgress *_progressFunc = nullptr;
    OTGWFirmwareReport *_firmwareFunc = nullptr;
+   OTGWMismatchReport *_mismatchFunc = nullptr;
    OTGWProcessor model = PIC16F88;
    int _reset, _led;
    byte _banner_matched[FIRMWARE_COUNT], _version_pos;
+   bool _differential = true;
 
-   OTGWError finishUpgrade(OTGWError result, short errors, short retries);
+   OTGWError newUpgrade();
+   OTGWError finishUpgrade(OTGWError result, short errors, short retries,
+     const OTGWUpgradeStats *stats = nullptr);
    void SetLED(int state);
    void progress(int pct);
+   void mismatch(bool eeprom, unsigned short addr, unsigned short expected,
+     unsigned short actual);
    void putbyte(uint8_t c);
    void matchBanner(char ch);
    bool upgradeEvent();
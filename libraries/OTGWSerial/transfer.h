@@ -0,0 +1,56 @@
+// Generated from data/transfer.dat by mktransfer.py - do not edit
+
+#define XFER_VERSION_LEN 9
+#define XFER_IDS 11
+
+// Firmware versions that changed the locations, in ascending order
+const char xferversions[][XFER_VERSION_LEN] PROGMEM = {
+    "3.0",
+    "4.0a3",
+    "4.0a6",
+    "4.0a7",
+    "4.0a9",
+    "4.0a9.1",
+    "4.0a10",
+    "4.0a11.1",
+    "4.0b0",
+    "4.0.1.1",
+    "4.1",
+    "4.2.7",
+    "4.2.8",
+    "5.5",
+    "6.0",
+    "6.2",
+    "6.3",
+};
+
+// Locations of the settings, sorted by version and id
+const struct TransferEntry xfertable[] PROGMEM = {
+    { 0,  0, 0x000,  1, 0xe0},  // SavedSettings
+    { 0,  1, 0x001,  4, 0x00},  // FunctionLED
+    { 0,  2, 0x0e0, 32, 0x00},  // AlternativeCmd
+    { 1,  3, 0x0d8,  8, 0x00},  // ThermResponse
+    { 2,  1, 0x004,  6, 0x00},  // FunctionLED
+    { 2,  4, 0x001,  1, 0x00},  // FunctionGPIO
+    { 2,  5, 0x002,  2, 0x00},  // AwaySetpoint
+    { 3,  6, 0x0aa, 16, 0x00},  // UnknownFlags
+    { 4,  1, 0x006,  6, 0x00},  // FunctionLED
+    { 4,  6, 0x0af, 16, 0x00},  // UnknownFlags
+    { 5,  6, 0x0b1, 16, 0x00},  // UnknownFlags
+    { 6,  6, 0x0b3, 16, 0x00},  // UnknownFlags
+    { 7,  6, 0x0b5, 16, 0x00},  // UnknownFlags
+    { 8,  0, 0x000,  1, 0x80},  // SavedSettings
+    { 8,  3, 0x0d8,  0, 0x00},  // ThermResponse
+    { 8,  6, 0x0d0, 16, 0x00},  // UnknownFlags
+    { 9,  7, 0x130,  1, 0x00},  // ThermostatModel
+    {10,  7, 0x00d,  1, 0x00},  // ThermostatModel
+    {11,  8, 0x00e,  1, 0xcf},  // Configuration
+    {12,  8, 0x00e,  1, 0xca},  // Configuration
+    {13,  9, 0x00f,  2, 0x00},  // DHWSetting
+    {13, 10, 0x011,  2, 0x00},  // MaxCHSetting
+    {14,  9, 0x000,  0, 0x00},  // DHWSetting
+    {14, 10, 0x000,  0, 0x00},  // MaxCHSetting
+    {15,  9, 0x00f,  2, 0x00},  // DHWSetting
+    {15, 10, 0x011,  2, 0x00},  // MaxCHSetting
+    {16,  8, 0x00e,  1, 0xc2},  // Configuration
+};
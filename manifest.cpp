@@ -0,0 +1,192 @@
+// Copyright (c) 2023 - Schelte Bron
+
+// Index of the PIC firmware files on the file system. Each PIC directory
+// has a line with just the directory name, followed by a line per hex
+// file: <dir> <file> <version> <size> <hash>. The lines are kept sorted,
+// so the files of a directory are grouped together.
+
+#include "otgwmcu.h"
+#include "debug.h"
+#include "manifest.h"
+#include <MD5Builder.h>
+
+#define MANIFEST_TMP "/firmware.tmp"
+
+int manifestparse(const char *line, char *dir, char *name, char *version, unsigned int *size, char *hash) {
+    return sscanf(line, "%15s %31s %15s %u %16s", dir, name, version, size, hash);
+}
+
+// Create the manifest line for a firmware file. Returns false if the file
+// doesn't exist.
+static bool manifestentry(const String &dir, const String &name, char *line, int size) {
+    char version[16] = "0.0";
+    MD5Builder md5;
+
+    File f = LittleFS.open("/" + dir + "/" + name, "r");
+    if (!f) return false;
+    unsigned int len = f.size();
+    md5.begin();
+    md5.addStream(f, len);
+    md5.calculate();
+    f.close();
+
+    String verfile = "/" + dir + "/" + name;
+    verfile.replace(".hex", ".ver");
+    f = LittleFS.open(verfile, "r");
+    if (f) {
+        int n = f.readBytesUntil('\n', version, sizeof(version) - 1);
+        version[n] = '\0';
+        f.close();
+        // The version is a single word
+        for (char *s = version; *s; s++) {
+            if (isspace(*s)) *s = '_';
+        }
+        if (n == 0) strcpy_P(version, PSTR("0.0"));
+    }
+
+    snprintf_P(line, size, PSTR("%s %s %s %u %.16s"), dir.c_str(), name.c_str(),
+      version, len, md5.toString().c_str());
+    return true;
+}
+
+// Write a line to the new manifest. Once a write has failed, nothing more
+// is written and the result stays false.
+static bool manifestline(File &out, const char *line, bool ok) {
+    return ok && out.printf("%s\n", line) == strlen(line) + 1;
+}
+
+// Rewrite the manifest, replacing all lines that start with key (if any)
+// by the new lines, which must be in sorted order. An empty key replaces
+// the complete manifest. The old manifest is kept if anything goes wrong.
+static void manifestmerge(const char *key, const char **lines, int count) {
+    char line[100];
+    int i = 0, keylen = key ? strlen(key) : 0;
+    bool ok = true;
+
+    File in = LittleFS.open(MANIFEST, "r");
+    File out = LittleFS.open(MANIFEST_TMP, "w");
+    if (!out) {
+        if (in) in.close();
+        return;
+    }
+    while (ok && in && in.available()) {
+        int n = in.readBytesUntil('\n', line, sizeof(line) - 1);
+        line[n] = '\0';
+        if (n == 0 || (key && strncmp(line, key, keylen) == 0)) continue;
+        while (i < count && strcmp(lines[i], line) < 0) {
+            ok = manifestline(out, lines[i++], ok);
+        }
+        if (i < count && strcmp(lines[i], line) == 0) continue;
+        ok = manifestline(out, line, ok);
+    }
+    while (i < count) {
+        ok = manifestline(out, lines[i++], ok);
+    }
+    if (in) in.close();
+    out.close();
+    // Renaming replaces the old manifest in one go
+    if (!ok || !LittleFS.rename(MANIFEST_TMP, MANIFEST)) {
+        debuglog(PSTR("Failed to update the firmware manifest\n"));
+        LittleFS.remove(MANIFEST_TMP);
+    }
+}
+
+// Replace the manifest line of a firmware file. The path has the form
+// /<dir>/<file>.hex. Without an entry, the file is removed from the list.
+static void manifestreplace(const String &path, const char *entry) {
+    char key[50];
+    const char *lines[2];
+    int count = 0, slash = path.indexOf('/', 1);
+
+    if (slash < 0 || !path.endsWith(".hex")) return;
+    String dir = path.substring(1, slash);
+    snprintf_P(key, sizeof(key), PSTR("%s %s "), dir.c_str(), path.c_str() + slash + 1);
+    // The directory line sorts before the entries of the directory
+    lines[count++] = dir.c_str();
+    if (entry) lines[count++] = entry;
+    manifestmerge(key, lines, count);
+}
+
+// Update the manifest after a firmware file was added, replaced, or
+// removed
+void manifestupdate(const String &path) {
+    char entry[100];
+    int slash = path.indexOf('/', 1);
+
+    if (slash < 0) return;
+    String dir = path.substring(1, slash);
+    String name = path.substring(slash + 1);
+    if (manifestentry(dir, name, entry, sizeof(entry))) {
+        manifestreplace(path, entry);
+    } else {
+        manifestreplace(path, nullptr);
+    }
+}
+
+// Update the manifest for a file whose details are already known
+void manifestupdate(const String &path, const char *version, unsigned int size, const char *hash) {
+    char entry[100];
+    int slash = path.indexOf('/', 1);
+
+    if (slash < 0) return;
+    String dir = path.substring(1, slash);
+    snprintf_P(entry, sizeof(entry), PSTR("%s %s %s %u %.16s"), dir.c_str(),
+      path.c_str() + slash + 1, *version ? version : "0.0", size, hash);
+    manifestreplace(path, entry);
+}
+
+static int linecompare(const void *a, const void *b) {
+    return strcmp(*(const char **)a, *(const char **)b);
+}
+
+// Collect the lines for all PIC directories and their hex files, up to
+// size. Without a list, only the number of lines is determined.
+static int manifestlines(String *list, int size = 0) {
+    char entry[100];
+    int count = 0;
+
+    Dir dir = LittleFS.openDir("/");
+    while (dir.next()) {
+        if (!dir.isDirectory()) continue;
+        if (list && count >= size) break;
+        String name = dir.fileName();
+        if (list) list[count] = name;
+        count++;
+        Dir subdir = LittleFS.openDir("/" + name);
+        while (subdir.next()) {
+            if (!subdir.fileName().endsWith(".hex")) continue;
+            if (list) {
+                if (count >= size) break;
+                if (!manifestentry(name, subdir.fileName(), entry, sizeof(entry))) {
+                    continue;
+                }
+                list[count] = entry;
+                // Each file is hashed completely
+                wdtevent();
+                yield();
+            }
+            count++;
+        }
+    }
+    return count;
+}
+
+// Build the manifest from scratch, in a single write
+void manifestscan() {
+    int count = manifestlines(nullptr);
+    String *list = new String[count];
+    const char **lines = new const char *[count];
+
+    // Files may have come or gone in the mean time
+    count = manifestlines(list, count);
+    for (int i = 0; i < count; i++) lines[i] = list[i].c_str();
+    qsort(lines, count, sizeof(*lines), linecompare);
+    manifestmerge("", lines, count);
+    delete[] lines;
+    delete[] list;
+    debuglog(PSTR("Firmware manifest created\n"));
+}
+
+void manifestsetup() {
+    if (!LittleFS.exists(MANIFEST)) manifestscan();
+}
@@ -0,0 +1,9 @@
+// Copyright (c) 2023 - Schelte Bron
+
+#define MANIFEST "/firmware.lst"
+
+void manifestsetup();
+void manifestscan();
+void manifestupdate(const String &path);
+void manifestupdate(const String &path, const char *version, unsigned int size, const char *hash);
+int manifestparse(const char *line, char *dir, char *name, char *version, unsigned int *size, char *hash);
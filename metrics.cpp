@@ -0,0 +1,241 @@
+// Copyright (c) 2023 - Schelte Bron
+
+#include <ESP8266WiFi.h>
+#include <cont.h>
+#include "webserver.h"
+#include "metrics.h"
+#include "filewriter.h"
+#include "proxy.h"
+
+// Text exposition format used by Prometheus
+#define METRICS_TYPE "text/plain; version=0.0.4"
+// Longest line a metric can produce
+#define METRICS_LINE 128
+
+extern WebServer httpd;
+extern unsigned errorcnt[4];
+
+Metrics metrics;
+
+static const char stagenames[STAGE_COUNT][8] PROGMEM = {
+    "main", "proxy", "command", "fetch", "debug", "web"
+};
+
+// What the current stage of the main loop is working on
+static char context[METRICS_CONTEXT];
+
+// Stages are timed with the CPU cycle counter, which is cheaper and more
+// precise than micros()
+uint32_t metricsstart() {
+    return ESP.getCycleCount();
+}
+
+// Keep the slowest stages, together with their context
+static void metricsworst(int stage, uint32_t elapsed) {
+    int i = METRICS_WORST - 1;
+    if (elapsed <= metrics.worst[i].time) return;
+    // Move faster entries down
+    for (; i > 0 && elapsed > metrics.worst[i - 1].time; i--) {
+        metrics.worst[i] = metrics.worst[i - 1];
+    }
+    MetricsEvent &event = metrics.worst[i];
+    event.time = elapsed;
+    event.when = millis();
+    event.stage = stage;
+    strcpy(event.context, context);
+}
+
+// Account the time since start to a stage of the main loop. Returns the
+// current cycle count, to be used as the start of the next stage.
+uint32_t metricsstage(int stage, uint32_t start) {
+    uint32_t now = ESP.getCycleCount();
+    uint32_t elapsed = (now - start) / ESP.getCpuFreqMHz();
+    int bucket = elapsed > 1 ? 32 - __builtin_clz(elapsed - 1) : 0;
+    metrics.histogram[stage][min(bucket, METRICS_BUCKETS - 1)]++;
+    metrics.looptime[stage] += elapsed;
+    if (elapsed > metrics.loopmax[stage]) metrics.loopmax[stage] = elapsed;
+    metricsworst(stage, elapsed);
+    context[0] = '\0';
+    return now;
+}
+
+// Describe the work done in the current stage, for the list of slowest stages
+void metricscontext(const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf_P(context, sizeof(context), fmt, args);
+    va_end(args);
+}
+
+// Produce the HELP and TYPE lines for a metric
+static int metrichead(char *buf, const char *name, const char *type, const char *help) {
+    return sprintf_P(buf, PSTR("# HELP otgw_%S %S\n# TYPE otgw_%S %S\n"),
+      name, help, name, type);
+}
+
+// Send the collected text if another line might not fit in the buffer.
+// Returns the new length of the text in the buffer.
+static int metricroom(char *buf, int n, int size) {
+    if (n <= size - METRICS_LINE) return n;
+    httpd.sendContent(buf, n);
+    return 0;
+}
+
+static void metric(const char *name, const char *type, const char *help, uint32_t value) {
+    char buf[256];
+    int n = metrichead(buf, name, type, help);
+    n += sprintf_P(buf + n, PSTR("otgw_%S %u\n"), name, value);
+    httpd.sendContent(buf, n);
+}
+
+// Metric with one value per label, taken from a table of label names
+static void metriclist(const char *name, const char *type, const char *help,
+  const char *label, const char *names, int size, int count, const uint32_t *value) {
+    char buf[640];
+    int n = metrichead(buf, name, type, help);
+    for (int i = 0; i < count; i++) {
+        n = metricroom(buf, n, sizeof(buf));
+        n += sprintf_P(buf + n, PSTR("otgw_%S{%S=\"%S\"} %u\n"),
+          name, label, names + i * size, value[i]);
+    }
+    httpd.sendContent(buf, n);
+}
+
+void metricspage() {
+    uint32_t value[STAGE_COUNT];
+    char buf[640];
+    int n, i;
+
+    httpd.chunkedResponseModeStart(200, METRICS_TYPE);
+
+    // System
+    metric(PSTR("uptime_seconds"), PSTR("counter"),
+      PSTR("Time since the last restart"), millis() / 1000);
+    metric(PSTR("heap_free_bytes"), PSTR("gauge"),
+      PSTR("Free heap memory"), ESP.getFreeHeap());
+    metric(PSTR("heap_max_block_bytes"), PSTR("gauge"),
+      PSTR("Largest free block of heap memory"), ESP.getMaxFreeBlockSize());
+    metric(PSTR("heap_fragmentation_percent"), PSTR("gauge"),
+      PSTR("Heap fragmentation"), ESP.getHeapFragmentation());
+    metric(PSTR("stack_max_bytes"), PSTR("gauge"),
+      PSTR("Deepest use of the main loop stack"),
+      CONT_STACKSIZE - ESP.getFreeContStack());
+
+    // Main loop
+    metric(PSTR("loop_iterations_total"), PSTR("counter"),
+      PSTR("Main loop iterations"), metrics.loops);
+    n = metrichead(buf, PSTR("loop_stage_seconds"), PSTR("histogram"),
+      PSTR("Duration of each stage of the main loop"));
+    for (i = 0; i < STAGE_COUNT; i++) {
+        uint32_t count = 0;
+        uint64_t t = metrics.looptime[i];
+        for (int j = 0; j < METRICS_BUCKETS; j++) {
+            count += metrics.histogram[i][j];
+            n = metricroom(buf, n, sizeof(buf));
+            n += sprintf_P(buf + n, PSTR("otgw_loop_stage_seconds_bucket{stage=\"%S\",le=\""), stagenames[i]);
+            if (j < METRICS_BUCKETS - 1) {
+                uint32_t le = 1 << j;
+                n += sprintf_P(buf + n, PSTR("%u.%06u"), le / 1000000, le % 1000000);
+            } else {
+                n += sprintf_P(buf + n, PSTR("+Inf"));
+            }
+            n += sprintf_P(buf + n, PSTR("\"} %u\n"), count);
+        }
+        n = metricroom(buf, n, sizeof(buf));
+        n += sprintf_P(buf + n, PSTR("otgw_loop_stage_seconds_sum{stage=\"%S\"} %u.%06u\n"),
+          stagenames[i], (uint32_t)(t / 1000000), (uint32_t)(t % 1000000));
+        n = metricroom(buf, n, sizeof(buf));
+        n += sprintf_P(buf + n, PSTR("otgw_loop_stage_seconds_count{stage=\"%S\"} %u\n"),
+          stagenames[i], count);
+    }
+    httpd.sendContent(buf, n);
+    metriclist(PSTR("loop_max_microseconds"), PSTR("gauge"),
+      PSTR("Longest single run of each stage of the main loop"),
+      PSTR("stage"), stagenames[0], sizeof(stagenames[0]), STAGE_COUNT,
+      metrics.loopmax);
+
+    // Serial interface to the PIC
+    metric(PSTR("uart_rx_bytes_total"), PSTR("counter"),
+      PSTR("Bytes received from the PIC"), metrics.uartrx);
+    metric(PSTR("uart_tx_bytes_total"), PSTR("counter"),
+      PSTR("Bytes sent to the PIC"), metrics.uarttx);
+    metric(PSTR("uart_overruns_total"), PSTR("counter"),
+      PSTR("Receive buffer overruns"), metrics.uartoverruns);
+
+    // Network clients
+    metric(PSTR("proxy_clients"), PSTR("gauge"),
+      PSTR("Connected serial proxy clients"), proxyclients());
+    metric(PSTR("proxy_connects_total"), PSTR("counter"),
+      PSTR("Accepted serial proxy connections"), metrics.proxyconnects);
+    metric(PSTR("proxy_rejects_total"), PSTR("counter"),
+      PSTR("Serial proxy connections refused for lack of a free slot"),
+      metrics.proxyrejects);
+    metric(PSTR("proxy_drops_total"), PSTR("counter"),
+      PSTR("Lines not sent to a congested serial proxy client"),
+      metrics.proxydrops);
+    for (n = 0, i = 0; i < WEBSOCKETS_CLIENT_MAX; i++) {
+        WSStats ws;
+        if (httpd.stats(i, ws)) n++;
+    }
+    metric(PSTR("websocket_clients"), PSTR("gauge"),
+      PSTR("Connected websocket clients"), n);
+    metric(PSTR("websocket_connects_total"), PSTR("counter"),
+      PSTR("Accepted websocket connections"), metrics.wsconnects);
+    metric(PSTR("websocket_drops_total"), PSTR("counter"),
+      PSTR("Messages not sent to a congested websocket client"),
+      metrics.wsdrops);
+
+    // OpenTherm
+    metriclist(PSTR("opentherm_frames_total"), PSTR("counter"),
+      PSTR("OpenTherm messages reported by the gateway"),
+      PSTR("source"), PSTR("A\0B\0R\0T"), 2, 4, metrics.otframes);
+    for (i = 0; i < 4; i++) value[i] = errorcnt[i];
+    metriclist(PSTR("opentherm_errors_total"), PSTR("counter"),
+      PSTR("OpenTherm errors reported by the gateway"),
+      PSTR("error"), PSTR("1\0002\0003\0004"), 2, 4, value);
+
+    // PIC firmware upgrades
+    metric(PSTR("upgrades_total"), PSTR("counter"),
+      PSTR("PIC firmware upgrades"), metrics.upgrades);
+    metric(PSTR("upgrade_failures_total"), PSTR("counter"),
+      PSTR("PIC firmware upgrades that failed"), metrics.upgradefails);
+    metric(PSTR("upgrade_errors_total"), PSTR("counter"),
+      PSTR("Verification errors during PIC firmware upgrades"),
+      metrics.upgradeerrors);
+    metric(PSTR("upgrade_retries_total"), PSTR("counter"),
+      PSTR("Retries during PIC firmware upgrades"), metrics.upgraderetries);
+    metric(PSTR("upgrade_timeouts_total"), PSTR("counter"),
+      PSTR("Bootloader replies that timed out during PIC firmware upgrades"),
+      metrics.upgradetimeouts);
+
+    // Buffered file writes
+    const FileWriterStats &fw = FileWriter::stats();
+    metric(PSTR("file_write_bytes_total"), PSTR("counter"),
+      PSTR("Bytes written to uploaded and downloaded files"), fw.bytes);
+    metric(PSTR("file_writes_total"), PSTR("counter"),
+      PSTR("Write calls to the file system"), fw.writes);
+
+    httpd.chunkedResponseFinalize();
+}
+
+// List the slowest stages of the main loop
+void latencypage() {
+    char buf[200];
+    int n;
+
+    httpd.chunkedResponseModeStart(200, "application/json");
+    httpd.sendContent_P(PSTR("["));
+    for (int i = 0; i < METRICS_WORST && metrics.worst[i].time; i++) {
+        const MetricsEvent &event = metrics.worst[i];
+        n = sprintf_P(buf, PSTR("%s\n{\"stage\":\"%S\",\"time\":%u,\"uptime\":%u,\"context\":\""),
+          i ? "," : "", stagenames[event.stage], event.time, event.when / 1000);
+        for (const char *s = event.context; *s; s++) {
+            if (*s == '"' || *s == '\\') buf[n++] = '\\';
+            buf[n++] = *s;
+        }
+        n += sprintf_P(buf + n, PSTR("\"}"));
+        httpd.sendContent(buf, n);
+    }
+    httpd.sendContent_P(PSTR("\n]\n"));
+    httpd.chunkedResponseFinalize();
+}
@@ -0,0 +1,55 @@
+// Copyright (c) 2023 - Schelte Bron
+
+#include <stdint.h>
+
+// Parts of the main loop that are timed separately
+enum {
+    STAGE_MAIN,
+    STAGE_PROXY,
+    STAGE_COMMAND,
+    STAGE_FETCH,
+    STAGE_DEBUG,
+    STAGE_WEB,
+    STAGE_COUNT
+};
+
+// Stage durations are collected in histograms with power of two buckets:
+// up to 1us, 2us, 4us, ... 32.768ms, and everything above that
+#define METRICS_BUCKETS 17
+// Slowest stages recorded, with a description of what they were doing
+#define METRICS_WORST 8
+#define METRICS_CONTEXT 48
+
+typedef struct {
+    uint32_t time;      // Duration (us)
+    uint32_t when;      // Uptime at the end of the stage (ms)
+    uint8_t stage;
+    char context[METRICS_CONTEXT];
+} MetricsEvent;
+
+// Counters are updated where the events happen, so producing the metrics
+// page doesn't involve any work beyond formatting the numbers
+typedef struct {
+    uint32_t loops;                     // Main loop iterations
+    uint64_t looptime[STAGE_COUNT];     // Time spent per stage (us)
+    uint32_t loopmax[STAGE_COUNT];      // Longest single run per stage (us)
+    uint32_t histogram[STAGE_COUNT][METRICS_BUCKETS];
+    MetricsEvent worst[METRICS_WORST];  // Slowest stages, longest first
+    uint32_t uartrx, uarttx;            // Bytes received from/sent to the PIC
+    uint32_t uartoverruns;              // Receive buffer overruns
+    uint32_t proxyconnects, proxyrejects;
+    uint32_t proxydrops;                // Lines not sent to a slow client
+    uint32_t wsconnects, wsdrops;
+    uint32_t otframes[4];               // OpenTherm messages by source: ABRT
+    uint32_t upgrades, upgradefails;
+    uint32_t upgradeerrors, upgraderetries;
+    uint32_t upgradetimeouts;           // Bootloader replies not in time
+} Metrics;
+
+extern Metrics metrics;
+
+uint32_t metricsstart();
+uint32_t metricsstage(int stage, uint32_t start);
+void metricscontext(const char *, ...);
+void metricspage();
+void latencypage();
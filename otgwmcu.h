@@ -14,12 +14,21 @@
 #define LED2 D0
 
 #define FIRMWARE "gateway.hex"
+#define PICBACKUP "/backup.img"
+#define PROFILEDIR "/profiles"
 #define OTA_URL "http://otgw.tclcode.com/ota"
+#define DOWNLOAD_URL "http://otgw.tclcode.com/download"
 
 extern OTGWSerial Pic;
 
 void wdtevent();
 int dumpattiny(char *buffer);
 void fwupgradestart(const char *hexfile);
+void fwupgradestart(OTGWUpgradeSource *source);
+void fwverifystart(const char *hexfile);
+void fwbackupstart(const char *imgfile);
+void fwrestorestart(const char *imgfile);
+void fwsettingssave(const char *profile);
+void fwsettingsload(const char *profile);
 String otaurl();
 void otaupgrade();
@@ -11,13 +11,19 @@
 #include "proxy.h"
 #include "debug.h"
 #include "web.h"
+#include "command.h"
+#include "fetch.h"
+#include "metrics.h"
 #include "version.h"
 
 #define WDTPERIOD 5000
 #define WDADDRESS 38
 #define WDPACKET 0xA5
+// Locations that differ from the firmware file, reported during a verify
+#define VERIFY_REPORTS 16
 
 OTGWSerial Pic(PICRST, LED2);
+static int verifymismatches;
 
 WiFiManager wifiManager;
 
@@ -78,10 +84,37 @@ void firmwarereport(OTGWFirmware fw, const char *version) {
       Pic.firmwareToString(fw).c_str(), version);
 }
 
-void fwupgradedone(OTGWError result, short errors = 0, short retries = 0) {
+// Log how long the bootloader took to reply to the different commands
+void fwstats(const OTGWUpgradeStats *stats) {
+    static const char names[] PROGMEM =
+      "reset\0version\0readprog\0writeprog\0eraseprog\0readdata\0writedata";
+    const char *name = names;
+
+    if (stats == nullptr) return;
+    debuglog(PSTR("PIC access took %lu ms, %u timeouts\n"),
+      stats->duration, stats->timeouts);
+    for (int i = 0; i < OTGW_CMD_COUNT; i++, name += strlen_P(name) + 1) {
+        const OTGWCommandStats *s = stats->cmd + i;
+        if (s->count == 0 && s->timeouts == 0) continue;
+        debuglog(PSTR("  %-9S %4u replies, %u timeouts, round trip %u/%u/%u ms"
+          " (50%%/90%%/max), timeout %u ms\n"), name, s->count, s->timeouts,
+          s->p50, s->p90, s->max, s->timeout);
+    }
+}
+
+void fwupgradedone(OTGWError result, short errors = 0, short retries = 0,
+  const OTGWUpgradeStats *stats = nullptr) {
+    if (result != OTGW_ERROR_INPROG) {
+        metrics.upgrades++;
+        if (result != OTGW_ERROR_NONE) metrics.upgradefails++;
+        metrics.upgradeerrors += errors;
+        metrics.upgraderetries += retries;
+        if (stats) metrics.upgradetimeouts += stats->timeouts;
+    }
     websockprogress(PSTR("{%s\"result\":%d,\"errors\":%d,\"retries\":%d}"),
       result ? "" : "\"percent\":100,", result, errors, retries);
     debuglog(PSTR("Upgrade finished: Errorcode = %d - %d retries, %d errors\n"), result, retries, errors);
+    fwstats(stats);
     switch (result) {
      case OTGW_ERROR_NONE:
         blink(0);
@@ -107,20 +140,97 @@ void fwupgradestep(int pct) {
     debuglog(PSTR("Upgrade: %d%%\n"), pct);
 }
 
+void fwupgradewatch(OTGWError result) {
+    if (result!= OTGW_ERROR_NONE) {
+        fwupgradedone(result);
+    } else {
+        Pic.registerProgressCallback(fwupgradestep);
+        Pic.registerFinishedCallback(fwupgradedone);
+    }
+}
+
 void fwupgradestart(const char *hexfile) {
-    OTGWError result;
+    blink(0);
+    digitalWrite(LED1, LOW);
+    fwupgradewatch(Pic.startUpgrade(hexfile));
+}
 
+// Program the PIC with hex data that is still arriving
+void fwupgradestart(OTGWUpgradeSource *source) {
     blink(0);
     digitalWrite(LED1, LOW);
-    result = Pic.startUpgrade(hexfile);
-    if (result!= OTGW_ERROR_NONE) {
-        fwupgradedone(result);
+    fwupgradewatch(Pic.startUpgrade(source));
+}
+
+// Reading the PIC memory (verify or backup) doesn't count as an upgrade
+void fwreaddone(OTGWError result, short errors = 0, short retries = 0,
+  const OTGWUpgradeStats *stats = nullptr) {
+    // For a verify, errors are the code rows and data blocks that differ
+    websockprogress(PSTR("{%s\"result\":%d,\"errors\":%d,\"retries\":%d}"),
+      result ? "" : "\"percent\":100,", result, errors, retries);
+    debuglog(PSTR("PIC read finished: Errorcode = %d - %d retries, %d mismatches\n"), result, retries, errors);
+    fwstats(stats);
+    if (result != OTGW_ERROR_INPROG) blink(result ? 500 : 0);
+}
+
+void fwreadwatch(OTGWError result) {
+    if (result != OTGW_ERROR_NONE) {
+        fwreaddone(result);
     } else {
         Pic.registerProgressCallback(fwupgradestep);
-        Pic.registerFinishedCallback(fwupgradedone);
+        Pic.registerFinishedCallback(fwreaddone);
     }
 }
 
+// Report where the PIC memory differs from the firmware file. Only the
+// first few locations, a completely different firmware would flood the
+// websocket otherwise.
+void fwmismatch(bool eeprom, unsigned short addr, unsigned short expected,
+  unsigned short actual) {
+    if (verifymismatches++ >= VERIFY_REPORTS) return;
+    websockprogress(PSTR("{\"mismatch\":{\"memory\":\"%s\",\"addr\":%u,"
+      "\"expected\":%u,\"actual\":%u}}"), eeprom ? "data" : "code",
+      addr, expected, actual);
+    debuglog(PSTR("Verify: %s 0x%04x is 0x%04x, expected 0x%04x\n"),
+      eeprom ? "data" : "code", addr, actual, expected);
+}
+
+// Compare the PIC memory with a firmware file, without programming it
+void fwverifystart(const char *hexfile) {
+    blink(0);
+    digitalWrite(LED1, LOW);
+    verifymismatches = 0;
+    Pic.registerMismatchCallback(fwmismatch);
+    fwreadwatch(Pic.startVerify(hexfile));
+}
+
+// Save the PIC program and data memory, to be able to go back to it later
+void fwbackupstart(const char *imgfile) {
+    blink(0);
+    digitalWrite(LED1, LOW);
+    fwreadwatch(Pic.startBackup(imgfile));
+}
+
+void fwrestorestart(const char *imgfile) {
+    blink(0);
+    digitalWrite(LED1, LOW);
+    fwupgradewatch(Pic.startRestore(imgfile));
+}
+
+// Keep a copy of the gateway settings, or put them back, without touching
+// the firmware
+void fwsettingssave(const char *profile) {
+    blink(0);
+    digitalWrite(LED1, LOW);
+    fwreadwatch(Pic.saveSettings(profile));
+}
+
+void fwsettingsload(const char *profile) {
+    blink(0);
+    digitalWrite(LED1, LOW);
+    fwupgradewatch(Pic.loadSettings(profile));
+}
+
 void wdtevent() {
     static unsigned int wdevent = 0;
 
@@ -235,7 +345,9 @@ void setup() {
 
 void loop() {
     static unsigned int pressed = 0;
+    uint32_t t = metricsstart();
 
+    metrics.loops++;
     wdtevent();
 
     if (!Pic.busy()) {
@@ -257,7 +369,15 @@ void loop() {
         }
     }
 
+    t = metricsstage(STAGE_MAIN, t);
     proxyevent();
+    t = metricsstage(STAGE_PROXY, t);
+    commandevent();
+    t = metricsstage(STAGE_COMMAND, t);
+    fetchevent();
+    t = metricsstage(STAGE_FETCH, t);
     debugevent();
+    t = metricsstage(STAGE_DEBUG, t);
     webevent();
+    metricsstage(STAGE_WEB, t);
 }
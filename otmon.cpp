@@ -31,6 +31,8 @@ struct {
     unsigned int message;
 } history[3600];
 
+extern WebServer httpd;
+
 unsigned errorcnt[4];
 static unsigned short store[64];
 static uint32_t storemap[2];
@@ -295,3 +297,48 @@ void initialreport(int num) {
     jsonbuf[cnt] = '}';
     websocketsend(num, jsonbuf);
 }
+
+// Export the tables used by otformat(), so browsers can decode binary records
+void otdata() {
+    char buffer[64];
+    int i, n;
+
+    httpd.sendHeader("Cache-Control", "max-age=86400");
+    httpd.chunkedResponseModeStart(200, "application/json");
+    httpd.sendContent_P(PSTR("{\"msgtypes\":["));
+    for (i = 0; i < 8; i++) {
+        n = sprintf(buffer, i ? ",\"" : "\"");
+        strcpy_P(buffer + n, msgtypes[i]);
+        strcat(buffer, "\"");
+        httpd.sendContent(buffer);
+    }
+    httpd.sendContent_P(PSTR("],\n\"msgids\":["));
+    for (i = 0; i < 128; i++) {
+        n = sprintf(buffer, i ? ",\n" : "\n");
+        if (msgids[i]) {
+            buffer[n++] = '"';
+            strcpy_P(buffer + n, msgids[i]);
+            strcat(buffer, "\"");
+        } else {
+            strcpy(buffer + n, "null");
+        }
+        httpd.sendContent(buffer);
+    }
+    httpd.sendContent_P(PSTR("],\n\"msgfmts\":["));
+    for (i = 0, n = 0; i < 128; i++) {
+        n += sprintf(buffer + n, i ? ",%d" : "%d", pgm_read_byte(msgfmts + i));
+        if (i % 16 == 15) {
+            httpd.sendContent(buffer, n);
+            n = 0;
+        }
+    }
+    httpd.sendContent_P(PSTR("],\n\"datetime\":["));
+    for (i = 0; i < (int)sizeof(datetimestr) / 4; i++) {
+        n = sprintf(buffer, i ? ",\"" : "\"");
+        strcpy_P(buffer + n, datetimestr + i * 4);
+        strcat(buffer, "\"");
+        httpd.sendContent(buffer);
+    }
+    httpd.sendContent_P(PSTR("]}\n"));
+    httpd.chunkedResponseFinalize();
+}
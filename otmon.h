@@ -4,3 +4,4 @@ void initialreport(int);
 void otstatus(unsigned);
 int otformat(char *, char, unsigned);
 void oterror(int);
+void otdata();
@@ -5,6 +5,8 @@
 #include "otmon.h"
 #include "debug.h"
 #include "web.h"
+#include "command.h"
+#include "metrics.h"
 
 #define ETX 0x04
 
@@ -14,7 +16,10 @@ const int port = 25238;
 
 WiFiServer proxy(port);
 WiFiClient proxyClients[MAX_SRV_CLIENTS];
+// The client has sent part of a line to the PIC
+static bool partial[MAX_SRV_CLIENTS];
 
+static const char otsources[] = "ABRT";
 static char line[80];
 static short linelen = 0;
 
@@ -31,6 +36,8 @@ void proxyevent() {
         for (i = 0; i < MAX_SRV_CLIENTS; i++) {
             if (!proxyClients[i]) { // equivalent to !proxyClients[i].connected()
                 proxyClients[i] = proxy.available();
+                partial[i] = false;
+                metrics.proxyconnects++;
                 break;
             }
         }
@@ -38,6 +45,7 @@ void proxyevent() {
         //no free/disconnected spot so reject
         if (i == MAX_SRV_CLIENTS) {
             proxy.available().println("busy");
+            metrics.proxyrejects++;
             // hints: proxy.available() is a WiFiClient with short-term scope
             // when out of scope, a WiFiClient will
             // - flush() - all data will be sent
@@ -48,18 +56,27 @@ void proxyevent() {
     //check TCP clients for data
     for (int i = 0; i < MAX_SRV_CLIENTS; i++) {
         while (proxyClients[i].available() && Pic.availableForWrite() > 0) {
-            Pic.write(proxyClients[i].read());
+            int ch = proxyClients[i].read();
+            Pic.write(ch);
+            partial[i] = ch != '\r' && ch != '\n';
+            metrics.uarttx++;
         }
     }
 
+    if (Pic.hasOverrun()) metrics.uartoverruns++;
+
     //check UART for data
     size_t len = (size_t)Pic.available();
     if (len) {
         char src[2];
         unsigned msg;
         int pos, errnum;
-        size_t cnt = Pic.readBytesUntil('\n', line + linelen, min(len, sizeof(line) - linelen));
+        size_t want = min(len, sizeof(line) - linelen);
+        size_t cnt = Pic.readBytesUntil('\n', line + linelen, want);
         linelen += cnt;
+        // The data is available, so reading only stops early at the line
+        // terminator, which is consumed but not stored
+        metrics.uartrx += cnt < want ? cnt + 1 : cnt;
         // Check for ETX to allow a firmware upgrade by an external tool
         if (cnt < len || line[linelen - 1] == ETX) {
             if (line[linelen - 1] != ETX) {
@@ -74,18 +91,40 @@ void proxyevent() {
                 // ensure write space is sufficient:
                 if (proxyClients[i].availableForWrite() >= linelen) {
                     size_t tcp_sent = proxyClients[i].write(line, linelen);
+                } else if (proxyClients[i]) {
+                    metrics.proxydrops++;
                 }
             }
 
             if (sscanf(line, "%1[ABRT]%8x%n", src, &msg, &pos) == 2 && pos == 9) {
+                metrics.otframes[strchr(otsources, src[0]) - otsources]++;
                 otstatus(msg);
                 // debugmsg(src[0], msg);
                 websockotmessage(src[0], msg);
             } else if (sscanf(line, "Error %d", &errnum) == 1) {
                 oterror(errnum);
+            } else {
+                commandresponse(line, linelen);
             }
 
             linelen = 0;
         }
     }
 }
+
+// Commands from other sources must not end up in the middle of a line
+// that a proxy client is typing
+bool proxylinefree() {
+    for (int i = 0; i < MAX_SRV_CLIENTS; i++) {
+        if (proxyClients[i] && partial[i]) return false;
+    }
+    return true;
+}
+
+int proxyclients() {
+    int cnt = 0;
+    for (int i = 0; i < MAX_SRV_CLIENTS; i++) {
+        if (proxyClients[i]) cnt++;
+    }
+    return cnt;
+}
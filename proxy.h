@@ -2,3 +2,5 @@
 
 void proxysetup();
 void proxyevent();
+int proxyclients();
+bool proxylinefree();
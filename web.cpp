@@ -4,25 +4,48 @@
 #include "webserver.h"
 #include "debug.h"
 #include "otmon.h"
+#include "command.h"
+#include "manifest.h"
+#include "fetch.h"
+#include "filewriter.h"
+#include "metrics.h"
 #include "version.h"
 #include <LittleFS.h>
-#include <ESP8266HTTPClient.h>
+#include <MD5Builder.h>
+#include <sys/time.h>
+
+// Binary message log records are sent in batches
+#define OTLOG_PROTOCOL "otlog.bin"
+#define OTLOG_BATCH_SIZE 32
+#define OTLOG_BATCH_TIME 250
 
 WebServer httpd(80);
 
 // Bitmaps for subscriptions of web socket clients
-static unsigned int ws_status, ws_otlog, ws_progress;
+static unsigned int ws_status, ws_otlog, ws_otbin, ws_progress, ws_command;
+
+// Batch header: seconds (4 bytes)
+// Records: microseconds since the header time (4), source (1), message (4)
+static uint8_t otbatch[4 + 9 * OTLOG_BATCH_SIZE];
+static unsigned int otbatchlen = 0, otbatchtime;
 
 static unsigned int updays = 0;
 
-static File fsUploadFile;
+static FileWriter fsUploadFile;
+// Validation of uploaded hex files
+static OTGWHexCheck *hexcheck = nullptr;
+static OTGWError hexresult;
+static MD5Builder hexmd5;
 
-const char *hexheaders[] = {
-    "Last-Modified",
-    "X-Version"
-};
+// Hex data uploaded for programming the PIC directly
+#define FLASHQUEUE 1024
+// Give up when the PIC doesn't take more data for this long (ms)
+#define FLASHWAIT 10000
+static OTGWStreamSource *flashsource = nullptr;
+static OTGWError flashresult;
 
-static const char useragent[] PROGMEM = "OTGWMCU " VERSION;
+// List of ETags generated by the Makefile
+#define ETAGFILE "/etags.txt"
 
 unsigned int uptime() {
     static unsigned int tstamp = 0;
@@ -48,7 +71,67 @@ int running(char *buffer) {
     return sprintf_P(buffer, PSTR("%lu days %02d:%02d:%02d.%03d"), updays, h, m, s, ms);
 }
 
+// Look up the ETag of a file in the list generated when the file system
+// image was built. Uploads remove the entry of the file they replace. As
+// a safety net for files changed in other ways, a different size also
+// means there is no ETag.
+static bool fileetag(const String &path, size_t size, char *etag) {
+    char line[100], name[64], hash[20];
+    unsigned int len;
+    bool found = false;
+
+    File f = LittleFS.open(ETAGFILE, "r");
+    if (!f) return false;
+    while (!found && f.available()) {
+        int n = f.readBytesUntil('\n', line, sizeof(line) - 1);
+        line[n] = '\0';
+        if (sscanf(line, "%63s %u %19s", name, &len, hash) == 3
+          && path == name) {
+            if (len == size) {
+                sprintf_P(etag, PSTR("\"%s\""), hash);
+                found = true;
+            } else {
+                break;
+            }
+        }
+    }
+    f.close();
+    return found;
+}
+
+// Forget the ETag of a file that is being replaced
+static void etagremove(const String &path) {
+    char line[100], name[64];
+    bool found = false, ok = true;
+
+    File f = LittleFS.open(ETAGFILE, "r");
+    if (!f) return;
+    File tmp = LittleFS.open(ETAGFILE ".tmp", "w");
+    if (!tmp) {
+        // Losing all ETags is better than keeping a stale one
+        f.close();
+        LittleFS.remove(ETAGFILE);
+        return;
+    }
+    while (f.available()) {
+        int n = f.readBytesUntil('\n', line, sizeof(line) - 1);
+        line[n] = '\0';
+        if (sscanf(line, "%63s", name) == 1 && path == name) {
+            found = true;
+        } else if (tmp.printf("%s\n", line) != (size_t)(n + 1)) {
+            ok = false;
+        }
+    }
+    f.close();
+    tmp.close();
+    if (found && ok && LittleFS.rename(ETAGFILE ".tmp", ETAGFILE)) return;
+    LittleFS.remove(ETAGFILE ".tmp");
+    if (found) LittleFS.remove(ETAGFILE);
+}
+
 bool servefile(String path) {
+    char etag[28];
+
     if (path.endsWith("/")) {
         path += "index.html";
     }
@@ -56,14 +139,31 @@ bool servefile(String path) {
     String contentType;
     contentType = mime::getContentType(path);
 
-    if (LittleFS.exists(path)) {
-        File file = LittleFS.open(path, "r");
-        httpd.streamFile(file, contentType);
-        file.close();
-        return true;
-    } else {
-        return false;
+    if (!LittleFS.exists(path)) return false;
+
+    File file = LittleFS.open(path, "r");
+    if (fileetag(path, file.size(), etag)) {
+        String gzpath = path + ".gz";
+        bool gzip = httpd.header("Accept-Encoding").indexOf("gzip") >= 0
+          && LittleFS.exists(gzpath);
+        // The compressed variant is a different representation
+        if (gzip) strcpy_P(etag + strlen(etag) - 1, PSTR("-gz\""));
+        httpd.sendHeader("ETag", etag);
+        httpd.sendHeader("Cache-Control", "no-cache");
+        httpd.sendHeader("Vary", "Accept-Encoding");
+        if (httpd.header("If-None-Match").indexOf(etag) >= 0) {
+            file.close();
+            httpd.send(304);
+            return true;
+        }
+        if (gzip) {
+            // streamFile() adds the Content-Encoding header for .gz files
+            file.close();
+            file = LittleFS.open(gzpath, "r");
+        }
     }
+    httpd.sendFile(file, contentType);
+    return true;
 }
 
 void listfiles() {
@@ -90,43 +190,38 @@ void mainpage() {
 }
 
 void filelist() {
-    char sep1 = '\0', sep2, s[400], version[16];
+    char sep1 = '\0', sep2, s[400], line[100];
+    char dir[16], name[32], version[16], hash[17];
+    unsigned int size;
     int n;
-    Dir dir;
     File f;
 
     httpd.chunkedResponseModeStart(200, "text/javascript");
     n = sprintf_P(s, PSTR("var ls={"));
-    dir = LittleFS.openDir("/");
-    while (dir.next()) {
-        if (!dir.isDirectory()) continue;
-        // if (!dir.fileName().startsWith("pic16f")) continue;
-        if (sep1) {s[n++] = sep1;} else {sep1 = ',';}
-        n += sprintf_P(s + n, PSTR("%s:["), dir.fileName().c_str());
-        sep2 = '\0';
-        Dir subdir = LittleFS.openDir("/" + dir.fileName());
-        while (subdir.next()) {
-            if (subdir.fileName().endsWith(".hex")) {
-                String verfile = "/" + dir.fileName() + "/" + subdir.fileName();
-                verfile.replace(".hex", ".ver");
-                f = LittleFS.open(verfile, "r");
-                if (f) {
-                    f.readBytesUntil('\n', version, 15);
-                    f.close();
-                } else {
-                    sprintf(version, "0.0");
-                }
-                if (sep2) {s[n++] = sep2;} else {sep2 = ',';}
-                n += sprintf_P(s + n, PSTR("{name:'%s',version:'%s',size:%d}"),
-                  subdir.fileName().c_str(), version, subdir.fileSize());
-            }
-            if (n >= 300) {
-                httpd.sendContent(s, n);
-                n = 0;
-            }
+    f = LittleFS.open(MANIFEST, "r");
+    while (f && f.available()) {
+        int len = f.readBytesUntil('\n', line, sizeof(line) - 1);
+        line[len] = '\0';
+        switch (manifestparse(line, dir, name, version, &size, hash)) {
+         case 1:
+            // Start of a new directory
+            if (sep1) {s[n++] = ']'; s[n++] = sep1;} else {sep1 = ',';}
+            n += sprintf_P(s + n, PSTR("%s:["), dir);
+            sep2 = '\0';
+            break;
+         case 5:
+            if (sep2) {s[n++] = sep2;} else {sep2 = ',';}
+            n += sprintf_P(s + n, PSTR("{name:'%s',version:'%s',size:%u,hash:'%s'}"),
+              name, version, size, hash);
+            break;
+        }
+        if (n >= 300) {
+            httpd.sendContent(s, n);
+            n = 0;
         }
-        s[n++] = ']';
     }
+    if (f) f.close();
+    if (sep1) s[n++] = ']';
     n += sprintf_P(s + n,
       PSTR("}\nvar processor = '%s', firmware = ['%s', '%s']\n"),
       Pic.processorToString().c_str(),
@@ -135,44 +230,16 @@ void filelist() {
     httpd.chunkedResponseFinalize();
 }
 
-void refresh(String filename, String version) {
-    WiFiClient client;
-    HTTPClient http;
-    String latest;
-    int code;
-
-    http.setUserAgent(FPSTR(useragent));
-    http.begin(client, "http://otgw.tclcode.com/download/" + filename);
-    http.collectHeaders(hexheaders, 2);
-    code = http.sendRequest("HEAD");
-    if (code == HTTP_CODE_OK) {
-        for (int i = 0; i< http.headers(); i++) {
-            debuglog(PSTR("%s: %s\n"), hexheaders[i], http.header(i).c_str());
-        }
-        latest = http.header(1);
-        if (latest != version) {
-            debuglog(PSTR("Update %s: %s -> %s\n"), filename.c_str(), version.c_str(), latest.c_str());
-            http.end();
-            http.begin(client, "http://otgw.tclcode.com/download/" + filename);
-            code = http.GET();
-            if (code == HTTP_CODE_OK) {
-                File f = LittleFS.open("/" + filename, "w");
-                if (f) {
-                    http.writeToStream(&f);
-                    f.close();
-                    String verfile = "/" + filename;
-                    verfile.replace(".hex", ".ver");
-                    f = LittleFS.open(verfile, "w");
-                    if (f) {
-                        f.print(latest + "\n");
-                        f.close();
-                        debuglog(PSTR("Update successful\n"));
-                    }
-                }
-            }
-        }
+// Profile names end up in a file name, so only allow a limited set of
+// characters
+static bool profilepath(const String &name, char *path) {
+    if (name.length() == 0 || name.length() > 16) return false;
+    for (unsigned int i = 0; i < name.length(); i++) {
+        char c = name[i];
+        if (!isalnum(c) && c != '_' && c != '-') return false;
     }
-    http.end();
+    sprintf_P(path, PSTR(PROFILEDIR "/%s.ee"), name.c_str());
+    return true;
 }
 
 void firmware() {
@@ -181,19 +248,48 @@ void firmware() {
     debuglog(PSTR("Action: %s %s\n"), action.c_str(), filename.c_str());
     if (action == "download") {
         fwupgradestart(String("/" + filename).c_str());
+    } else if (action == "verify") {
+        fwverifystart(String("/" + filename).c_str());
+    } else if (action == "backup") {
+        fwbackupstart(PICBACKUP);
+    } else if (action == "restore") {
+        fwrestorestart(PICBACKUP);
+    } else if (action == "savesettings" || action == "loadsettings") {
+        String profile = httpd.arg("profile");
+        char path[32];
+        if (!profilepath(profile, path)) {
+            httpd.send(400, "text/plain", "Invalid profile name");
+            return;
+        } else if (action == "savesettings") {
+            fwsettingssave(path);
+        } else {
+            fwsettingsload(path);
+        }
     } else if (action == "update") {
-        String version = httpd.arg("version");
-        refresh(filename, version);
+        // The file is downloaded in the background
+        fetchqueue(filename.c_str());
     } else if (action == "delete") {
         String path = "/" + filename;
         LittleFS.remove(path);
+        manifestupdate(path);
         path.replace(".hex", ".ver");
         LittleFS.remove(path);
+        path.replace(".ver", ".img");
+        LittleFS.remove(path);
     }
     httpd.sendHeader("Location", "firmware.html", true);
     httpd.send(303, "text/html", "<a href='firmware.html'>Return</a>");
 }
 
+const char *wstopic(int num) {
+    if (bitRead(ws_status, num)) return "status";
+    if (bitRead(ws_otbin, num)) return "otlog binary";
+    if (bitRead(ws_otlog, num)) return "otlog";
+    if (bitRead(ws_progress, num)) return "download";
+    if (bitRead(ws_command, num)) return "command";
+    return "unknown";
+}
+
 void debuginfo() {
     FSInfo fsinfo;
     char buffer[250];
@@ -247,6 +343,21 @@ void debuginfo() {
     cnt += dumpattiny(buffer + cnt);
     cnt += sprintf_P(buffer + cnt, PSTR("<br>\n"));
     httpd.sendContent(buffer, cnt);
+    // Buffered file writes
+    const FileWriterStats &fw = FileWriter::stats();
+    sprintf_P(buffer, PSTR("File writes: %u bytes, %u writes, %u ms, max %u us<br>\n"),
+      fw.bytes, fw.writes, fw.time / 1000, fw.maxtime);
+    httpd.sendContent(buffer);
+    // Websocket sessions
+    for (int i = 0; i < WEBSOCKETS_CLIENT_MAX; i++) {
+        WSStats ws;
+        if (!httpd.stats(i, ws)) continue;
+        sprintf_P(buffer, PSTR("Websocket %d (%s): %s:%u, %us, %u frames, "
+          "%u bytes, %u dropped, queue %u, rtt %ums<br>\n"),
+          i, wstopic(i), ws.ip.toString().c_str(), ws.port, ws.uptime / 1000,
+          ws.frames, ws.bytes, ws.drops, ws.queue, ws.rtt);
+        httpd.sendContent(buffer);
+    }
 
     httpd.sendContent_P(PSTR("</body>\n</html>\n"));
     httpd.chunkedResponseFinalize();
@@ -297,40 +408,64 @@ void wsstatus(uint8_t num, WStype_t type, uint8_t *payload, size_t length) {
     }
 }
 
+void otbatchflush() {
+    uint8_t num;
+    unsigned int n;
+
+    if (otbatchlen == 0) return;
+    for (n = ws_otbin, num = 0; n != 0; n >>= 1, num++) {
+        if (n & 1) httpd.sendBIN(num, otbatch, otbatchlen);
+    }
+    otbatchlen = 0;
+}
+
 void websockotmessage(char dir, unsigned message) {
     char buffer[256];
     int len;
 
-    if (ws_otlog != 0) {
+    if ((ws_otlog & ~ws_otbin) != 0) {
         len = otformat(buffer, dir, message);
-        websockdistribute(buffer, ws_otlog);
+        websockdistribute(buffer, ws_otlog & ~ws_otbin);
+    }
+    if (ws_otbin != 0) {
+        timeval now;
+        uint32_t sec, usec;
+        gettimeofday(&now, nullptr);
+        if (otbatchlen == 0) {
+            sec = now.tv_sec;
+            memcpy(otbatch, &sec, 4);
+            otbatchlen = 4;
+            otbatchtime = millis();
+        } else {
+            memcpy(&sec, otbatch, 4);
+        }
+        usec = (now.tv_sec - sec) * 1000000 + now.tv_usec;
+        memcpy(otbatch + otbatchlen, &usec, 4);
+        otbatch[otbatchlen + 4] = dir;
+        memcpy(otbatch + otbatchlen + 5, &message, 4);
+        otbatchlen += 9;
+        if (otbatchlen >= sizeof(otbatch)) otbatchflush();
     }
 }
 
 void wsotlog(uint8_t num, WStype_t type, uint8_t *payload, size_t length) {
     websocket(num, type, &ws_otlog);
+    if (type == WStype_CONNECTED && payload != nullptr) {
+        // The client will decode packed records itself
+        ws_otbin |= 1 << num;
+    } else if (type == WStype_DISCONNECTED) {
+        ws_otbin &= ~(1 << num);
+    }
 }
 
 void otainfo() {
-    WiFiClient client;
-    HTTPClient http;
-    char buffer[80];
-    String latest = "unknown";
-    // Don't spend too much time waiting for a response
-    http.setTimeout(1000);
-    http.setUserAgent(FPSTR(useragent));
-    if (http.begin(client, otaurl() + "/version.txt")) {
-        http.addHeader("x-ESP8266-STA-MAC", WiFi.macAddress());
-        int code = http.GET();
-        if (code == HTTP_CODE_OK) {
-            latest = http.getString();
-        }
-        http.end();
-    }
-    // Remove the newline at the end of the file
-    latest.trim();
-    int len = sprintf_P(buffer, 
-      PSTR("{\"version\":\"" VERSION "\",\"latest\":\"%s\"}"), latest.c_str());
+    char buffer[100], latest[16];
+    // The version check is done in the background
+    if (httpd.hasArg("refresh")) otacheck();
+    int age = otaversion(latest, sizeof(latest));
+    int len = sprintf_P(buffer,
+      PSTR("{\"version\":\"" VERSION "\",\"latest\":\"%s\",\"age\":%d}"),
+      latest, age);
     httpd.send(200, "application/json", buffer, len);
 }
 
@@ -350,6 +485,15 @@ void wsdownload(uint8_t num, WStype_t type, uint8_t *payload, size_t length) {
     websocket(num, type, &ws_progress);
 }
 
+void wscommand(uint8_t num, WStype_t type, uint8_t *payload, size_t length) {
+    websocket(num, type, &ws_command);
+    if (type == WStype_TEXT) {
+        commandqueue(num, (const char *)payload);
+    } else if (type == WStype_DISCONNECTED) {
+        commanddrop(num);
+    }
+}
+
 void httpota() {
     const char *message = PSTR(
       "<!DOCTYPE html>\n"
@@ -377,21 +521,84 @@ void httpota() {
     otaupgrade();
 }
 
+static const char *hexerror(OTGWError result) {
+    switch (result) {
+     case OTGW_ERROR_MEMORY:
+        return PSTR("Not enough space on the file system");
+     case OTGW_ERROR_HEX_FORMAT:
+        return PSTR("Invalid firmware file format");
+     case OTGW_ERROR_HEX_DATASIZE:
+        return PSTR("Wrong data size in hex file");
+     case OTGW_ERROR_HEX_CHECKSUM:
+        return PSTR("Bad checksum in hex file");
+     case OTGW_ERROR_MAGIC:
+        return PSTR("Hex file contains unexpected data");
+     case OTGW_ERROR_DEVICE:
+        return PSTR("The selected firmware is for a different PIC");
+     case OTGW_ERROR_INPROG:
+        return PSTR("Firmware upgrade in progress");
+     default:
+        return PSTR("Upload failed");
+    }
+}
+
+// Discard an upload that turned out to be invalid
+static void uploadreject(OTGWError result) {
+    fsUploadFile.discard();
+    hexresult = result;
+    debuglog(PSTR("Upload rejected: error %d\n"), result);
+}
+
 void uploadmain() {
-    if (fsUploadFile) {
+    if (fsUploadFile && hexcheck && hexresult == OTGW_ERROR_NONE && httpd.arg("pic") != ""
+      && httpd.arg("pic") != Pic.processorToString(hexcheck->processor())) {
+        uploadreject(OTGW_ERROR_DEVICE);
+    }
+    bool created = fsUploadFile;
+    if (created && !fsUploadFile.close()) {
+        // The last part of the file could not be written
+        LittleFS.remove(fsUploadFile.path());
+        hexresult = OTGW_ERROR_MEMORY;
+    }
+    if (hexresult == OTGW_ERROR_MEMORY) {
+        httpd.send_P(500, "text/plain", hexerror(hexresult));
+    } else if (hexresult != OTGW_ERROR_NONE) {
+        httpd.send_P(400, "text/plain", hexerror(hexresult));
+    } else if (created) {
         const char *location = "upload.html";
-        String name = fsUploadFile.fullName();
-        fsUploadFile.close();
+        String name = fsUploadFile.path();
+        size_t size = fsUploadFile.size();
+        // Don't serve an outdated compressed copy of the file
+        if (LittleFS.exists(name + ".gz")) LittleFS.remove(name + ".gz");
+        // Nor with an ETag that belongs to the old contents
+        etagremove(name);
         if (httpd.arg("pic")) {
             String dir = httpd.arg("pic");
             if (dir != "") {
                 bool result = LittleFS.rename(name, "/" + dir + name);
+                etagremove("/" + dir + name);
                 if (name.endsWith(".hex")) {
+                    String hexfile = "/" + dir + name;
+                    String version = httpd.arg("version");
+                    // Prefer the version found in the file itself
+                    if (hexcheck && *hexcheck->version()) {
+                        version = hexcheck->version();
+                    }
                     name.replace(".hex", ".ver");
-                    fsUploadFile = LittleFS.open("/" + dir + name, "w");
-                    if (fsUploadFile) {
-                        fsUploadFile.printf("%s\n", httpd.arg("version").c_str());
-                        fsUploadFile.close();
+                    File f = LittleFS.open("/" + dir + name, "w");
+                    if (f) {
+                        f.printf("%s\n", version.c_str());
+                        f.close();
+                    }
+                    // The preparsed image belongs to the old file
+                    name.replace(".ver", ".img");
+                    LittleFS.remove("/" + dir + name);
+                    if (hexcheck) {
+                        hexmd5.calculate();
+                        manifestupdate(hexfile, version.c_str(), size,
+                          hexmd5.toString().c_str());
+                    } else {
+                        manifestupdate(hexfile);
                     }
                 }
                 location = "firmware.html";
@@ -403,6 +610,8 @@ void uploadmain() {
     } else {
         httpd.send(500, "text/plain", "500: couldn't create file");
     }
+    delete hexcheck;
+    hexcheck = nullptr;
 }
 
 void uploadfile() {
@@ -415,16 +624,106 @@ void uploadfile() {
         filename = httpd.arg("target") + "/" + filename;
         debuglog(PSTR("handleFileUpload Name: %s\n"), filename.c_str());
         // Open the file for writing (create if it doesn't exist)
-        fsUploadFile = LittleFS.open(filename, "w");
+        fsUploadFile.open(filename);
+        delete hexcheck;
+        hexcheck = nullptr;
+        hexresult = OTGW_ERROR_NONE;
+        if (filename.endsWith(".hex")) {
+            // Check the contents while the file is coming in
+            hexcheck = new OTGWHexCheck();
+            hexmd5.begin();
+        }
         break;
      case UPLOAD_FILE_WRITE:
         // Write the received bytes to the file
-        if (fsUploadFile)
-          fsUploadFile.write(upload.buf, upload.currentSize);
+        if (fsUploadFile) {
+            if (fsUploadFile.write(upload.buf, upload.currentSize) != upload.currentSize) {
+                // Most likely the file system is full
+                uploadreject(OTGW_ERROR_MEMORY);
+            } else if (hexcheck) {
+                hexmd5.add(upload.buf, upload.currentSize);
+                OTGWError rc = hexcheck->feed(upload.buf, upload.currentSize);
+                if (rc != OTGW_ERROR_NONE) uploadreject(rc);
+            }
+        }
         break;
      case UPLOAD_FILE_END:
         // The file is closed by uploadmain()
         debuglog(PSTR("handleFileUpload Size: %d\n"), upload.totalSize);
+        if (fsUploadFile && hexcheck) {
+            OTGWError rc = hexcheck->finish();
+            if (rc != OTGW_ERROR_NONE) uploadreject(rc);
+        }
+        break;
+     case UPLOAD_FILE_ABORTED:
+        fsUploadFile.discard();
+        break;
+    }
+}
+
+void flashmain() {
+    if (flashresult != OTGW_ERROR_NONE) {
+        httpd.send_P(409, "text/plain", hexerror(flashresult));
+    } else {
+        // The result of the upgrade is reported on the firmware page
+        httpd.sendHeader("Location", "firmware.html");
+        httpd.send(303);
+    }
+    // The PIC may still be busy with the data memory
+    if (flashsource && !Pic.busy()) {
+        delete flashsource;
+        flashsource = nullptr;
+    }
+}
+
+// Feed the uploaded hex file to the PIC without storing it. The upload is
+// held back while the PIC is programmed, which slows down the sender.
+void flashfile() {
+    size_t pos = 0;
+    unsigned int start;
+
+    HTTPUpload& upload = httpd.upload();
+    switch (upload.status) {
+     case UPLOAD_FILE_START:
+        debuglog(PSTR("Flash: %s\n"), upload.filename.c_str());
+        if (Pic.busy()) {
+            flashresult = OTGW_ERROR_INPROG;
+            break;
+        }
+        delete flashsource;
+        flashsource = new OTGWStreamSource(FLASHQUEUE);
+        flashresult = OTGW_ERROR_NONE;
+        fwupgradestart(flashsource);
+        break;
+     case UPLOAD_FILE_WRITE:
+        if (flashresult != OTGW_ERROR_NONE || !flashsource) break;
+        start = millis();
+        while (pos < upload.currentSize) {
+            size_t n = flashsource->write(upload.buf + pos, upload.currentSize - pos);
+            if (n > 0) start = millis();
+            pos += n;
+            if (pos < upload.currentSize) {
+                // Wait for the PIC to make room in the queue
+                if (!Pic.busy()) break;
+                if (millis() - start > FLASHWAIT) {
+                    debuglog(PSTR("Flash: PIC stopped taking data\n"));
+                    flashsource->abort();
+                    flashresult = OTGW_ERROR_RETRIES;
+                    break;
+                }
+                wdtevent();
+                // The upgrade progress is reported over the websockets
+                httpd.websockets();
+                yield();
+            }
+        }
+        break;
+     case UPLOAD_FILE_END:
+        debuglog(PSTR("Flash Size: %d\n"), upload.totalSize);
+        if (flashresult == OTGW_ERROR_NONE && flashsource) flashsource->end();
+        break;
+     case UPLOAD_FILE_ABORTED:
+        if (flashresult == OTGW_ERROR_NONE && flashsource) flashsource->abort();
         break;
     }
 }
@@ -476,6 +775,7 @@ void upgradefile() {
 }
 
 void websetup() {
+    manifestsetup();
     // Serve files from flash file system
     httpd.onNotFound(servefilesys);
     // Special web pages
@@ -483,20 +783,30 @@ void websetup() {
     httpd.on("/filelist.js", HTTP_GET, filelist);
     httpd.on("/firmware.html", HTTP_POST, firmware);
     httpd.on("/debug.html", HTTP_GET, debuginfo);
+    httpd.on("/otdata.json", HTTP_GET, otdata);
+    httpd.on("/metrics", HTTP_GET, metricspage);
+    httpd.on("/latency.json", HTTP_GET, latencypage);
     // Web sockets
     httpd.on("/status.ws", HTTP_GET, [](){httpd.upgrade(wsstatus);});
-    httpd.on("/otlog.ws", HTTP_GET, [](){httpd.upgrade(wsotlog);});
+    httpd.on("/otlog.ws", HTTP_GET, [](){httpd.upgrade(wsotlog, true, OTLOG_PROTOCOL);});
     httpd.on("/download.ws", HTTP_GET, [](){httpd.upgrade(wsdownload);});
+    httpd.on("/command.ws", HTTP_GET, [](){httpd.upgrade(wscommand);});
     // Maintenance
     httpd.on("/upload.html", HTTP_POST, uploadmain, uploadfile);
+    httpd.on("/flash.html", HTTP_POST, flashmain, flashfile);
     httpd.on("/upgrade.html", HTTP_POST, upgrademain, upgradefile);
     httpd.on("/otainfo.json", HTTP_GET, otainfo);
     httpd.on("/ota.html", HTTP_GET, httpota);
 
+    // Compress the message log, keeping the LZ77 window between messages
+    httpd.compression(WEBSOCKETS_WINDOW_BITS, true);
     httpd.begin();
 }
 
 void webevent() {
     httpd.handleClient();
+    if (otbatchlen && millis() - otbatchtime >= OTLOG_BATCH_TIME) {
+        otbatchflush();
+    }
     uptime();
 }
@@ -2,6 +2,8 @@
 
 #include "webserver.h"
 #include "debug.h"
+#include "metrics.h"
+#include <lwip/tcp.h>
 #include <Hash.h>
 #include <base64.h>
 
@@ -12,15 +14,22 @@ const char* websockheaders[] {
     "Sec-WebSocket-Key",
     "Sec-WebSocket-Version",
     "Upgrade",
-    "Referer"
+    "Referer",
+    "Sec-WebSocket-Extensions",
+    "Sec-WebSocket-Protocol",
+    // Used for serving static files
+    "Accept-Encoding",
+    "If-None-Match"
 };
 
 // WebSocket class
 // Constructor
-WebSocket::WebSocket(uint8_t id, WiFiClient &client)
-: _client(client), _id(id), _dataLen(0), _callback(nullptr) {
+WebSocket::WebSocket(uint8_t id, WiFiClient &client, Deflate *deflate, const char *protocol)
+: _client(client), _id(id), _dataLen(0), _dataSize(0), _fill(0), _message(0),
+  _callback(nullptr), _deflate(deflate), _protocol(protocol), _pingSent(0), _stats() {
     // Do not block while waiting for data
     _client.setTimeout(0);
+    _opened = _lastRx = millis();
 
     debuglog(PSTR("Connection opened from: %s:%d\n"), _client.remoteIP().toString().c_str(), _client.remotePort());
 }
@@ -29,6 +38,7 @@ WebSocket::WebSocket(uint8_t id, WiFiClient &client)
 WebSocket::~WebSocket()
 {
     _client.stop();
+    delete _deflate;
     debuglog(PSTR("Connection closed\n"));
 }
 
@@ -46,100 +56,200 @@ void WebSocket::callback(wsCallback cb)
 {
     _callback = cb;
     if (_callback) {
-        _callback(_id, WStype_CONNECTED, nullptr, 0);
+        // Report the negotiated subprotocol, if any
+        if (_protocol) {
+            _callback(_id, WStype_CONNECTED, (uint8_t *)_protocol, strlen(_protocol));
+        } else {
+            _callback(_id, WStype_CONNECTED, nullptr, 0);
+        }
     }
 }
 
-bool WebSocket::loop() {
+// Parse the header of the next frame, when it has been received completely
+bool WebSocket::readHeader() {
     uint8_t len;
     int hdrSize;
-    bool ret = true;
 
-    if (!_client.connected()) {
-        return false;
+    if (_client.available() < 2) return false;
+    _client.peekBytes(_header, 2);
+    len = _header[1] & 0x7f;
+    if (len == 126) {
+        hdrSize = 4;
+    } else if (len == 127) {
+        hdrSize = 10;
+    } else {
+        hdrSize = 2;
     }
-    if (_dataLen > _dataSize) {
-        if (_client.available()) {
-            _dataSize += _client.read(_payload + _dataSize, _dataLen - _dataSize);
-            if (_dataSize == _dataLen) {
-                uint8_t *mask = _header + 2;
-                len = _header[1] & 0x7f;
-                if (len == 126) mask += 2;
-                if (len == 127) mask += 8;
-                for (size_t i = 0; i < _dataLen; i++) {
-                    _payload[i] ^= mask[i & 3];
-                }
-                WSopcode_t opcode = (WSopcode_t)(_header[0] & 0x7f);
-                switch (opcode) {
-                 case WSop_text:
-                    if (_callback) {
-                        _payload[_dataLen] = '\0';
-                        _callback(_id, WStype_TEXT, _payload, _dataLen);
-                    }
-                    break;
-                 case WSop_binary:
-                    if (_callback) {
-                        _callback(_id, WStype_BIN, _payload, _dataLen);
-                    }
-                    break;
-                 case WSop_continuation:
-                    break;
-                 case WSop_ping:
-                    sendFrame(WSop_pong, _payload, _dataLen);
-                    break;
-                 case WSop_pong:
-                    break;
-                 case WSop_close: {
-                     uint16_t reason = 1000;
-                     if (_dataLen >= 2) {
-                         reason = _payload[0] << 8 | _payload[1];
-                     }
-                     disconnect(reason);
-                     ret = false;
-                     break;
-                 }
-                 default:
-                    disconnect(1002);
-                    ret = false;
-                    break;
-                }
-                _dataLen = 0;
+    bool mask = _header[1] & bit(7);
+    if (mask) {
+        hdrSize += 4;
+    }
+    if (_client.available() < hdrSize) return false;
+    _client.read(_header, hdrSize);
+
+    unsigned int hdrPtr = 2;
+    _dataLen = 0;
+    if (len < 126) {
+        _dataLen = len;
+    } else if (len == 126) {
+        _dataLen = _header[hdrPtr++];
+        _dataLen = _dataLen << 8 | _header[hdrPtr++];
+    } else {
+        // Frames of 4GB and more are refused below
+        for (int i = 0; i < 4; i++) {
+            if (_header[hdrPtr++] != 0) _dataLen = SIZE_MAX;
+        }
+        if (_dataLen == 0) {
+            for (int i = 0; i < 4; i++) {
+                _dataLen = _dataLen << 8 | _header[hdrPtr++];
             }
+        } else {
+            hdrPtr += 4;
         }
-    } else if (_client.available() >= 2) {
-        _client.peekBytes(_header, 2);
-        len = _header[1] & 0x7f;
-        if (len == 126) {
-            hdrSize = 4;
-        } else if (len == 127) {
-            hdrSize = 10;
+    }
+    if (mask) {
+        memcpy(_mask, _header + hdrPtr, 4);
+    } else {
+        memset(_mask, 0, 4);
+    }
+    _dataSize = 0;
+    return true;
+}
+
+// Report a complete message, or the next part of a large message
+bool WebSocket::deliver(bool fin) {
+    WStype_t type;
+
+    if (!_streaming && fin) {
+        if (_compressed) {
+            // RSV1 indicates a compressed message (RFC 7692)
+            uint8_t buffer[MAX_PAYLOAD_SIZE];
+            // Leave room for the string terminator
+            int size = Deflate::inflate(_payload, _fill, buffer, MAX_PAYLOAD_SIZE - 1);
+            if (size < 0) return false;
+            memcpy(_payload, buffer, size);
+            _fill = size;
+        }
+        type = _message == WSop_text ? WStype_TEXT : WStype_BIN;
+    } else if (!_streaming) {
+        type = _message == WSop_text ? WStype_FRAGMENT_TEXT_START : WStype_FRAGMENT_BIN_START;
+        _streaming = true;
+    } else {
+        type = fin ? WStype_FRAGMENT_FIN : WStype_FRAGMENT;
+    }
+    if (_callback) {
+        _payload[_fill] = '\0';
+        _callback(_id, type, _payload, _fill);
+    }
+    _fill = 0;
+    return true;
+}
+
+bool WebSocket::loop() {
+    uint16_t reason = 0;
+
+    if (!_client.connected() || !keepalive()) {
+        // Let the application know the connection is gone
+        if (_callback) {
+            _callback(_id, WStype_DISCONNECTED, nullptr, 0);
+        }
+        return false;
+    }
+    if (_dataSize >= _dataLen) {
+        // Waiting for a new frame
+        if (!readHeader()) return true;
+        _opcode = _header[0] & 0x0f;
+        bool fin = _header[0] & bit(7);
+        if (!(_header[1] & bit(7)) || (_header[0] & 0x30)) {
+            // Client frames must be masked. RSV2 and RSV3 are not used.
+            reason = 1002;
+        } else if (_opcode & 0x08) {
+            // Control frames may appear in the middle of a fragmented message
+            if (!fin || _dataLen > sizeof(_control) - 1) reason = 1002;
+        } else if (_opcode == WSop_continuation) {
+            if (_message == 0 || (_header[0] & bit(6))) reason = 1002;
+        } else if (_opcode == WSop_text || _opcode == WSop_binary) {
+            if (_message != 0) reason = 1002;
+            _message = _opcode;
+            _compressed = _header[0] & bit(6);
+            if (_compressed && !_deflate) reason = 1002;
+            _streaming = false;
+            _fill = 0;
         } else {
-            hdrSize = 2;
+            reason = 1002;
         }
-        bool mask = _header[1] & bit(7);
-        if (mask) {
-            hdrSize += 4;
+        if (_dataLen == SIZE_MAX) reason = 1009;
+        if (reason) {
+            disconnect(reason);
+            return false;
         }
-        unsigned int hdrPtr = 2;
-        if (_client.available() >= hdrSize) {
-            _client.read(_header, hdrSize);
-            if (len < 126) {
-                _dataLen = len;
-            } else if (len == 126) {
-                _dataLen = _header[hdrPtr++];
-                _dataLen = _dataLen << 8 | _header[hdrPtr++];
-            } else {
-                hdrPtr += 4;
-                _dataLen = _dataLen << 8 | _header[hdrPtr++];
-                _dataLen = _dataLen << 8 | _header[hdrPtr++];
+    }
+
+    if (_opcode & 0x08) {
+        // Control frame
+        if (_dataSize < _dataLen && _client.available()) {
+            _dataSize += _client.read(_control + _dataSize, _dataLen - _dataSize);
+        }
+        if (_dataSize < _dataLen) return true;
+        for (size_t i = 0; i < _dataLen; i++) {
+            _control[i] ^= _mask[i & 3];
+        }
+        switch (_opcode) {
+         case WSop_ping:
+            sendFrame(WSop_pong, _control, _dataLen);
+            break;
+         case WSop_pong:
+            if (_pingSent && _dataLen == 4) {
+                uint32_t sent;
+                memcpy(&sent, _control, 4);
+                _stats.rtt = millis() - sent;
+                _pingSent = 0;
+            }
+            break;
+         case WSop_close:
+            reason = 1000;
+            if (_dataLen >= 2) {
+                reason = _control[0] << 8 | _control[1];
             }
-            _dataSize = 0;
+            disconnect(reason);
+            return false;
+         default:
+            disconnect(1002);
+            return false;
         }
+        return true;
     }
-    return ret;
+
+    // Data frame: Collect as much as fits in the payload buffer
+    if (_dataSize < _dataLen && _client.available()) {
+        size_t cnt = min(_dataLen - _dataSize, MAX_PAYLOAD_SIZE - 1 - _fill);
+        cnt = _client.read(_payload + _fill, cnt);
+        for (size_t i = 0; i < cnt; i++) {
+            _payload[_fill + i] ^= _mask[(_dataSize + i) & 3];
+        }
+        _fill += cnt;
+        _dataSize += cnt;
+    }
+    if (_dataSize >= _dataLen && (_header[0] & bit(7))) {
+        // Last frame of the message
+        bool valid = deliver(true);
+        _message = 0;
+        if (!valid) {
+            disconnect(1007);
+            return false;
+        }
+    } else if (_fill >= MAX_PAYLOAD_SIZE - 1) {
+        if (_compressed) {
+            // Compressed messages can only be inflated as a whole
+            disconnect(1009);
+            return false;
+        }
+        deliver(false);
+    }
+    return true;
 }
 
-bool WebSocket::sendFrame(WSopcode_t opcode, uint8_t * payload, size_t length)
+bool WebSocket::sendFrame(WSopcode_t opcode, uint8_t * payload, size_t length, bool compressed)
 {
     uint8_t buffer[WEBSOCKETS_MAX_HEADER_SIZE] = {0};
     uint8_t headerSize;
@@ -163,6 +273,10 @@ bool WebSocket::sendFrame(WSopcode_t opcode, uint8_t * payload, size_t length)
     if (fin) {
         *headerPtr |= bit(7);
     }
+    // RSV1 marks a compressed message
+    if (compressed) {
+        *headerPtr |= bit(6);
+    }
     headerPtr++;
 
     // Length & Mask
@@ -192,29 +306,106 @@ bool WebSocket::sendFrame(WSopcode_t opcode, uint8_t * payload, size_t length)
         ret = false;
     }
 
+    if (ret) {
+        _stats.frames++;
+        _stats.bytes += headerSize + length;
+    } else {
+        _stats.drops++;
+        metrics.wsdrops++;
+    }
     return ret;
 }
 
-bool WebSocket::sendTXT(const char *str) {
-    if (_client.connected()) {
-        return sendFrame(WSop_text, (uint8_t *)str, strlen(str));
-    } else {
+// Send a text or binary message. Messages are dropped when the client
+// doesn't keep up, rather than blocking the main loop.
+bool WebSocket::sendData(WSopcode_t opcode, const uint8_t *data, size_t len) {
+    if (!_client.connected()) {
+        return false;
+    }
+    // Check before compressing, a dropped message must not end up in the
+    // compression history
+    if ((size_t)_client.availableForWrite() < len + WEBSOCKETS_MAX_HEADER_SIZE) {
+        _stats.drops++;
+        metrics.wsdrops++;
         return false;
     }
+    if (_deflate && len <= MAX_PAYLOAD_SIZE) {
+        uint8_t buffer[Deflate::bound(len)];
+        size_t size = _deflate->compress(data, len, buffer, sizeof(buffer));
+        if (size) return sendFrame(opcode, buffer, size, true);
+    }
+    return sendFrame(opcode, (uint8_t *)data, len);
+}
+
+bool WebSocket::sendTXT(const char *str) {
+    return sendData(WSop_text, (const uint8_t *)str, strlen(str));
+}
+
+bool WebSocket::sendBIN(const uint8_t *data, size_t len) {
+    return sendData(WSop_binary, data, len);
+}
+
+// Check that the peer is still there. Returns false for a dead peer.
+bool WebSocket::keepalive() {
+    unsigned long now = millis();
+
+    if (_client.available()) {
+        _lastRx = now;
+    } else if (_pingSent) {
+        if (now - _pingSent > WEBSOCKETS_PONG_TIMEOUT && now - _lastRx > WEBSOCKETS_PONG_TIMEOUT) {
+            debuglog(PSTR("[%u] No response to ping\n"), _id);
+            return false;
+        }
+    } else if (now - _lastRx > WEBSOCKETS_PING_INTERVAL) {
+        // The time stamp comes back in the pong, to determine the round trip time
+        uint8_t payload[4];
+        memcpy(payload, &now, 4);
+        // Even if the ping can't be sent, a dead peer will time out
+        _pingSent = now ? now : 1;
+        sendFrame(WSop_ping, payload, 4);
+    }
+    return true;
+}
+
+void WebSocket::stats(WSStats &stats) {
+    stats = _stats;
+    stats.ip = _client.remoteIP();
+    stats.port = _client.remotePort();
+    stats.queue = TCP_SND_BUF - _client.availableForWrite();
+    stats.uptime = millis() - _opened;
 }
 
 // WebServer class
 WebServer::WebServer(int port)
-: ESP8266WebServer(port) {
+: ESP8266WebServer(port), _wsbits(0), _wstakeover(true) {
     // Specify the important headers
-    collectHeaders(websockheaders, 5);
+    collectHeaders(websockheaders, sizeof(websockheaders) / sizeof(*websockheaders));
 }
 
-void WebServer::handleClient() {
-    int i;
+// Allow permessage-deflate on websockets that ask for it. A windowbits
+// value of 0 disables compression. Without context takeover each message
+// is compressed on its own, which gains little for short messages.
+void WebServer::compression(uint8_t windowbits, bool takeover) {
+    _wsbits = windowbits;
+    _wstakeover = takeover;
+}
 
+void WebServer::handleClient() {
     ESP8266WebServer::handleClient();
-    for (i = 0; i < WEBSOCKETS_CLIENT_MAX; i++) {
+    if (_currentUri.length()) {
+        // A request was handled
+        metricscontext(PSTR("%s %s"), _currentMethod == HTTP_POST ? "POST" :
+          _currentMethod == HTTP_HEAD ? "HEAD" : "GET", _currentUri.c_str());
+        _currentUri = String();
+    }
+    filestreams();
+    websockets();
+}
+
+// Service the websockets. A request handler that has to wait for a while
+// calls this to keep them going.
+void WebServer::websockets() {
+    for (int i = 0; i < WEBSOCKETS_CLIENT_MAX; i++) {
         if (_wsclients[i]) {
             if (!_wsclients[i]->loop()) {
                 delete _wsclients[i];
@@ -224,9 +415,10 @@ void WebServer::handleClient() {
     }
 }
 
-int WebServer::upgrade(wsCallback cb) {
+int WebServer::upgrade(wsCallback cb, bool compress, const char *protocol) {
     uint8_t ws;
-    String acceptKey;
+    String acceptKey, extensions;
+    Deflate *deflate = nullptr;
 
     // Find a free websocket slot
     for (ws = 0; ws < WEBSOCKETS_CLIENT_MAX; ws++) {
@@ -242,15 +434,35 @@ int WebServer::upgrade(wsCallback cb) {
         return -1;
     }
 
-    _wsclients[ws] = new WebSocket(ws, _currentClient);
+    if (compress && _wsbits) {
+        uint8_t windowbits;
+        bool takeover;
+        extensions = wsdeflate(windowbits, takeover);
+        if (extensions.length()) {
+            deflate = new Deflate(windowbits, takeover);
+        }
+    }
+
+    // Only use the subprotocol if the client asked for it
+    if (protocol && !wsprotocol(protocol)) {
+        protocol = nullptr;
+    }
+
+    _wsclients[ws] = new WebSocket(ws, _currentClient, deflate, protocol);
+    metrics.wsconnects++;
 
     // Accept the websocket connection
     String handshake = "HTTP/1.1 101 Switching Protocols\r\n"
       "Upgrade: websocket\r\n"
       "Connection: Upgrade\r\n"
-      "Sec-WebSocket-Version: 13\r\n"
-      "Sec-WebSocket-Accept: ";
-    handshake += acceptKey + "\r\n\r\n";
+      "Sec-WebSocket-Version: 13\r\n";
+    if (deflate) {
+        handshake += "Sec-WebSocket-Extensions: " + extensions + "\r\n";
+    }
+    if (protocol) {
+        handshake += "Sec-WebSocket-Protocol: " + String(protocol) + "\r\n";
+    }
+    handshake += "Sec-WebSocket-Accept: " + acceptKey + "\r\n\r\n";
     _currentClient.print(handshake);
 
     // Don't let the standard processing close the connection
@@ -262,11 +474,84 @@ int WebServer::upgrade(wsCallback cb) {
     return ws;
 }
 
+// Send the response headers for a file and leave the contents to be sent
+// by filestreams(). The web server takes ownership of the file.
+void WebServer::sendFile(File &file, const String &contentType) {
+    int i;
+
+    for (i = 0; i < FILESTREAM_MAX; i++) {
+        if (!_streams[i].file) break;
+    }
+    if (i >= FILESTREAM_MAX) {
+        // Too many downloads in progress, send the file in one go
+        streamFile(file, contentType);
+        file.close();
+        return;
+    }
+
+    setContentLength(file.size());
+    if (String(file.name()).endsWith(".gz")
+      && contentType != "application/x-gzip"
+      && contentType != "application/octet-stream") {
+        sendHeader("Content-Encoding", "gzip");
+    }
+    send(200, contentType, "");
+    if (_currentMethod == HTTP_HEAD) {
+        file.close();
+        return;
+    }
+
+    _streams[i].file = file;
+    _streams[i].client = _currentClient;
+    // Don't let the standard processing wait for the connection to close
+    _currentClient = WiFiClient();
+}
+
+// Send the next parts of the files being downloaded, without hogging the
+// processor for more than FILESTREAM_TIME microseconds
+void WebServer::filestreams() {
+    uint8_t buffer[FILESTREAM_CHUNK];
+    unsigned long start = micros();
+    bool busy;
+
+    do {
+        busy = false;
+        for (int i = 0; i < FILESTREAM_MAX; i++) {
+            FileStream &stream = _streams[i];
+            if (!stream.file) continue;
+            if (!stream.client.connected() || !stream.file.available()) {
+                stream.file.close();
+                // The connection is closed when the last reference is gone
+                stream.client = WiFiClient();
+                continue;
+            }
+            size_t len = stream.client.availableForWrite();
+            if (len == 0) continue;
+            if (len > sizeof(buffer)) len = sizeof(buffer);
+            len = stream.file.read(buffer, len);
+            stream.client.write(buffer, len);
+            busy = true;
+        }
+    } while (busy && micros() - start < FILESTREAM_TIME);
+}
+
 bool WebServer::sendTXT(int num, const char *str)
 {
     return (_wsclients[num] && _wsclients[num]->sendTXT(str));
 }
 
+bool WebServer::sendBIN(int num, const uint8_t *data, size_t len)
+{
+    return (_wsclients[num] && _wsclients[num]->sendBIN(data, len));
+}
+
+bool WebServer::stats(int num, WSStats &stats)
+{
+    if (_wsclients[num] == nullptr) return false;
+    _wsclients[num]->stats(stats);
+    return true;
+}
+
 String WebServer::wschecks() {
     String ret, headerValue;
 
@@ -309,3 +594,85 @@ String WebServer::wschecks() {
     ret = base64::encode(sha1HashBin, 20, false);
     return ret;
 }
+
+String WebServer::wsdeflate(uint8_t &windowbits, bool &takeover) {
+    String ret, offers = header("Sec-WebSocket-Extensions");
+    int start = 0, end, pos, next;
+
+    // Look for a permessage-deflate offer that can be accepted (RFC 7692)
+    offers.toLowerCase();
+    while (start < (int)offers.length()) {
+        end = offers.indexOf(',', start);
+        if (end < 0) end = offers.length();
+        String offer = offers.substring(start, end);
+        start = end + 1;
+
+        pos = offer.indexOf(';');
+        String name = offer.substring(0, pos < 0 ? offer.length() : pos);
+        name.trim();
+        if (name != "permessage-deflate") continue;
+
+        bool accept = true, maxbits = false;
+        windowbits = _wsbits;
+        takeover = _wstakeover;
+        while (pos >= 0 && accept) {
+            next = offer.indexOf(';', pos + 1);
+            String param = offer.substring(pos + 1, next < 0 ? offer.length() : next);
+            String value;
+            pos = next;
+            int eq = param.indexOf('=');
+            if (eq >= 0) {
+                value = param.substring(eq + 1);
+                value.replace("\"", "");
+                value.trim();
+                param.remove(eq);
+            }
+            param.trim();
+            if (param == "server_no_context_takeover") {
+                takeover = false;
+            } else if (param == "client_no_context_takeover") {
+                // Always requested by the server
+            } else if (param == "server_max_window_bits") {
+                int bits = value.toInt();
+                if (bits < 8 || bits > 15) {
+                    accept = false;
+                } else if (bits < windowbits) {
+                    windowbits = bits;
+                }
+                maxbits = true;
+            } else if (param == "client_max_window_bits") {
+                // The value is optional, but must be valid when specified
+                if (value.length() && (value.toInt() < 8 || value.toInt() > 15)) {
+                    accept = false;
+                }
+            } else {
+                accept = false;
+            }
+        }
+        if (!accept) continue;
+
+        // Incoming messages are decompressed into the payload buffer, which
+        // requires that the client compresses each message independently
+        ret = F("permessage-deflate; client_no_context_takeover");
+        if (!takeover) ret += F("; server_no_context_takeover");
+        if (maxbits) ret += "; server_max_window_bits=" + String(windowbits);
+        break;
+    }
+    return ret;
+}
+
+// Check if the client offers the specified subprotocol
+bool WebServer::wsprotocol(const char *protocol) {
+    String offers = header("Sec-WebSocket-Protocol");
+    int start = 0, end;
+
+    while (start < (int)offers.length()) {
+        end = offers.indexOf(',', start);
+        if (end < 0) end = offers.length();
+        String name = offers.substring(start, end);
+        name.trim();
+        if (name == protocol) return true;
+        start = end + 1;
+    }
+    return false;
+}
@@ -1,8 +1,22 @@
 // Copyright (c) 2021 - Schelte Bron
 #include <ESP8266WebServer.h>
+#include <FS.h>
+#include "deflate.h"
 
 #define WEBSOCKETS_CLIENT_MAX 8
 #define MAX_PAYLOAD_SIZE 500
+// LZ77 window for permessage-deflate: 512 bytes
+#define WEBSOCKETS_WINDOW_BITS 9
+// Ping clients that have been quiet for a while, and drop them if they
+// don't respond
+#define WEBSOCKETS_PING_INTERVAL 15000
+#define WEBSOCKETS_PONG_TIMEOUT 10000
+
+// Files are sent in pieces from the main loop, so other tasks can run
+#define FILESTREAM_MAX 4
+#define FILESTREAM_CHUNK 512
+// Maximum time spent sending file data per call of handleClient() (us)
+#define FILESTREAM_TIME 4000
 
 typedef enum {
     WStype_ERROR,
@@ -29,24 +43,57 @@ typedef enum {
 
 typedef void (*wsCallback)(uint8_t, WStype_t, uint8_t *, size_t);
 
+typedef struct {
+    WiFiClient client;
+    File file;
+} FileStream;
+
+typedef struct {
+    IPAddress ip;
+    uint16_t port;
+    uint32_t uptime;    // Time since the connection was opened (ms)
+    uint32_t frames;    // Frames sent
+    uint32_t bytes;     // Bytes sent, including frame headers
+    uint32_t drops;     // Messages dropped because the client was too slow
+    uint16_t queue;     // Bytes waiting in the TCP send buffer
+    uint16_t rtt;       // Round trip time of the last ping (ms)
+} WSStats;
+
 class WebSocket {
 public:
-   WebSocket(uint8_t, WiFiClient&);
+   WebSocket(uint8_t, WiFiClient&, Deflate * = nullptr, const char * = nullptr);
    virtual ~WebSocket();
 
    virtual void callback(wsCallback);
    virtual bool loop();
    virtual void disconnect(uint16_t code);
    bool sendTXT(const char *);
+   bool sendBIN(const uint8_t *, size_t);
+   void stats(WSStats &);
 
 protected:
    WiFiClient _client;
    uint8_t _id;
    uint8_t _header[14];
+   uint8_t _mask[4];
+   // Control frames may arrive in the middle of a fragmented message
+   uint8_t _control[126];
    uint8_t _payload[MAX_PAYLOAD_SIZE];
-   size_t _dataLen, _dataSize;
+   // Frame length and bytes received, bytes collected in the payload buffer
+   size_t _dataLen, _dataSize, _fill;
+   // Opcodes of the current frame and message
+   uint8_t _opcode, _message;
+   bool _compressed, _streaming;
    wsCallback _callback;
-   bool sendFrame(WSopcode_t, uint8_t *, size_t);
+   Deflate *_deflate;
+   const char *_protocol;
+   unsigned long _opened, _lastRx, _pingSent;
+   WSStats _stats;
+   bool sendFrame(WSopcode_t, uint8_t *, size_t, bool = false);
+   bool sendData(WSopcode_t, const uint8_t *, size_t);
+   bool keepalive();
+   bool readHeader();
+   bool deliver(bool);
 };
 
 class WebServer : public ESP8266WebServer {
@@ -54,10 +101,21 @@ public:
    WebServer(int port = 80);
 
    virtual void handleClient();
-   virtual int upgrade(wsCallback);
+   void websockets();
+   virtual int upgrade(wsCallback, bool = false, const char * = nullptr);
    bool sendTXT(int, const char *);
+   bool sendBIN(int, const uint8_t *, size_t);
+   bool stats(int, WSStats &);
+   void compression(uint8_t, bool = true);
+   void sendFile(File &, const String &);
 
 protected:
    WebSocket *_wsclients[WEBSOCKETS_CLIENT_MAX];
+   FileStream _streams[FILESTREAM_MAX];
+   uint8_t _wsbits;
+   bool _wstakeover;
    String wschecks();
+   String wsdeflate(uint8_t &, bool &);
+   bool wsprotocol(const char *);
+   void filestreams();
 };